@@ -0,0 +1,310 @@
+#include <baro.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+#include "util.h"
+#include "log.h"
+
+struct buffer *buffer_create(size_t cap) {
+    struct buffer *buffer = malloc(sizeof(struct buffer) + cap);
+    ASSERT(buffer != NULL);
+
+    atomic_init(&buffer->refs, 1);
+    buffer->len = 0;
+    buffer->cap = cap;
+    return buffer;
+}
+
+struct buffer *buffer_ref(struct buffer *buffer) {
+    atomic_fetch_add(&buffer->refs, 1);
+    return buffer;
+}
+
+void buffer_destroy(struct buffer *buffer) {
+    if (atomic_fetch_sub(&buffer->refs, 1) == 1) {
+        free(buffer);
+    }
+}
+
+// Whether anyone else holds a reference, in which case the buffer can't be
+// written to. A buffer only we hold can't become shared behind our back
+static bool is_shared(struct buffer *buffer) {
+    return atomic_load(&buffer->refs) > 1;
+}
+
+void buffer_queue_create(struct buffer_queue *queue) {
+    *queue = (struct buffer_queue){0};
+}
+
+void buffer_queue_destroy(struct buffer_queue *queue) {
+    for (size_t i = 0; i < queue->num_buffers; i++) {
+        buffer_destroy(queue->buffers[(queue->head + i) % queue->cap]);
+    }
+    free(queue->buffers);
+
+    *queue = (struct buffer_queue){0};
+}
+
+#define QUEUE_AT(queue, i) ((queue)->buffers[((queue)->head + (i)) % (queue)->cap])
+
+static void push_buffer(struct buffer_queue *queue, struct buffer *buffer) {
+    // Grow the ring, unwrapping it into the new allocation
+    if (queue->num_buffers == queue->cap) {
+        size_t const new_cap = queue->cap ? queue->cap * 2 : 4;
+        struct buffer **buffers = malloc(new_cap * sizeof(*buffers));
+        ASSERT(buffers != NULL);
+
+        for (size_t i = 0; i < queue->num_buffers; i++) {
+            buffers[i] = QUEUE_AT(queue, i);
+        }
+        free(queue->buffers);
+
+        queue->buffers = buffers;
+        queue->head = 0;
+        queue->cap = new_cap;
+    }
+
+    queue->buffers[(queue->head + queue->num_buffers++) % queue->cap] = buffer;
+}
+
+void buffer_queue_append(struct buffer_queue *queue, char const *data, size_t len) {
+    queue->len += len;
+
+    while (len > 0) {
+        struct buffer *tail = queue->num_buffers ? QUEUE_AT(queue, queue->num_buffers - 1) : NULL;
+        if (tail == NULL || tail->len == tail->cap || is_shared(tail)) {
+            tail = buffer_create(SSB_MAX(len, BUFFER_CHUNK_SIZE));
+            push_buffer(queue, tail);
+        }
+
+        size_t const to_copy = SSB_MIN(len, tail->cap - tail->len);
+        memcpy(tail->data + tail->len, data, to_copy);
+        tail->len += to_copy;
+
+        data += to_copy;
+        len -= to_copy;
+    }
+}
+
+char *buffer_queue_reserve(struct buffer_queue *queue, size_t min_len, size_t *len) {
+    struct buffer *tail = queue->num_buffers ? QUEUE_AT(queue, queue->num_buffers - 1) : NULL;
+    if (tail != NULL && tail->len == 0 && tail->cap < min_len && !is_shared(tail)) {
+        // Swap out an empty tail rather than leaving a hole in the queue
+        tail = buffer_create(min_len);
+        buffer_destroy(QUEUE_AT(queue, queue->num_buffers - 1));
+        QUEUE_AT(queue, queue->num_buffers - 1) = tail;
+    }
+    else if (tail == NULL || tail->cap - tail->len < min_len || is_shared(tail)) {
+        tail = buffer_create(SSB_MAX(min_len, BUFFER_CHUNK_SIZE));
+        push_buffer(queue, tail);
+    }
+
+    *len = tail->cap - tail->len;
+    return tail->data + tail->len;
+}
+
+void buffer_queue_append_buffer(struct buffer_queue *queue, struct buffer *buffer) {
+    if (buffer->len == 0) {
+        return;
+    }
+
+    // Drop an empty tail that was only kept around to be refilled, since it
+    // would end up stuck in the middle of the queue
+    if (queue->num_buffers > 0 && QUEUE_AT(queue, queue->num_buffers - 1)->len == 0) {
+        buffer_destroy(QUEUE_AT(queue, --queue->num_buffers));
+    }
+
+    push_buffer(queue, buffer_ref(buffer));
+    queue->len += buffer->len;
+}
+
+void buffer_queue_splice(struct buffer_queue *queue, struct buffer_queue *other) {
+    for (size_t i = 0; i < other->num_buffers; i++) {
+        struct buffer *buffer = QUEUE_AT(other, i);
+        if (i == 0 && other->offset > 0) {
+            // Can't hand over a partially consumed buffer as is
+            buffer_queue_append(queue, buffer->data + other->offset, buffer->len - other->offset);
+        }
+        else {
+            buffer_queue_append_buffer(queue, buffer);
+        }
+    }
+
+    buffer_queue_destroy(other);
+}
+
+void buffer_queue_commit(struct buffer_queue *queue, size_t len) {
+    struct buffer *tail = QUEUE_AT(queue, queue->num_buffers - 1);
+    ASSERT(tail->len + len <= tail->cap);
+
+    tail->len += len;
+    queue->len += len;
+}
+
+char *buffer_queue_peek(struct buffer_queue *queue, size_t *len) {
+    if (queue->len == 0) {
+        *len = 0;
+        return NULL;
+    }
+
+    struct buffer *head = QUEUE_AT(queue, 0);
+    *len = head->len - queue->offset;
+    return head->data + queue->offset;
+}
+
+size_t buffer_queue_peek_iov(struct buffer_queue *queue, struct iovec *iov, size_t max_iov) {
+    size_t num_iov = 0;
+    size_t offset = queue->offset;
+    for (size_t i = 0; i < queue->num_buffers && num_iov < max_iov; i++) {
+        struct buffer *buffer = QUEUE_AT(queue, i);
+        if (buffer->len > offset) {
+            iov[num_iov++] = (struct iovec){
+                    .iov_base = buffer->data + offset,
+                    .iov_len = buffer->len - offset,
+            };
+        }
+        offset = 0;
+    }
+    return num_iov;
+}
+
+void buffer_queue_consume(struct buffer_queue *queue, size_t len) {
+    ASSERT(len <= queue->len);
+    queue->len -= len;
+
+    while (len > 0) {
+        struct buffer *head = QUEUE_AT(queue, 0);
+
+        size_t const remaining = head->len - queue->offset;
+        if (len < remaining) {
+            queue->offset += len;
+            return;
+        }
+
+        len -= remaining;
+        queue->offset = 0;
+
+        // Keep the last buffer around to be refilled, since a drained queue
+        // usually gets appended to again on the next tick
+        if (queue->num_buffers == 1 && !is_shared(head)) {
+            head->len = 0;
+            break;
+        }
+
+        buffer_destroy(head);
+        queue->head = (queue->head + 1) % queue->cap;
+        queue->num_buffers--;
+    }
+}
+
+TEST("[buffer] buffer_queue") {
+    struct buffer_queue queue;
+    buffer_queue_create(&queue);
+
+    size_t len = 1337;
+    REQUIRE_EQ(buffer_queue_peek(&queue, &len), NULL);
+    REQUIRE_EQ(len, 0);
+
+    SUBTEST("appends are contiguous within a buffer") {
+        buffer_queue_append(&queue, "hello ", 6);
+        buffer_queue_append(&queue, "world", 5);
+        REQUIRE_EQ(queue.len, 11);
+
+        char *data = buffer_queue_peek(&queue, &len);
+        REQUIRE_EQ(len, 11);
+        REQUIRE(!memcmp(data, "hello world", 11));
+    }
+
+    SUBTEST("partial consumes advance within the head buffer") {
+        buffer_queue_consume(&queue, 6);
+        char *data = buffer_queue_peek(&queue, &len);
+        REQUIRE_EQ(len, 5);
+        REQUIRE(!memcmp(data, "world", 5));
+
+        buffer_queue_consume(&queue, 5);
+        REQUIRE_EQ(queue.len, 0);
+        REQUIRE_EQ(buffer_queue_peek(&queue, &len), NULL);
+    }
+
+    SUBTEST("large appends span multiple buffers") {
+        static char big[BUFFER_CHUNK_SIZE * 3];
+        for (size_t i = 0; i < sizeof(big); i++) {
+            big[i] = (char) i;
+        }
+
+        for (int i = 0; i < 10; i++) {
+            buffer_queue_append(&queue, "x", 1);
+        }
+        buffer_queue_append(&queue, big, sizeof(big));
+        REQUIRE_EQ(queue.len, sizeof(big) + 10);
+
+        size_t consumed = 0;
+        buffer_queue_consume(&queue, 10);
+        char *data;
+        while ((data = buffer_queue_peek(&queue, &len)) != NULL) {
+            REQUIRE(!memcmp(data, big + consumed, len));
+            consumed += len;
+            buffer_queue_consume(&queue, len);
+        }
+        REQUIRE_EQ(consumed, sizeof(big));
+    }
+
+    SUBTEST("reserved space is queued once committed") {
+        size_t avail;
+        char *data = buffer_queue_reserve(&queue, 4, &avail);
+        REQUIRE(avail >= 4);
+        memcpy(data, "abcd", 4);
+        REQUIRE_EQ(queue.len, 0);
+
+        buffer_queue_commit(&queue, 4);
+        REQUIRE_EQ(queue.len, 4);
+
+        // Too big for what's left of the tail, so it gets a fresh buffer
+        size_t const min_len = avail;
+        data = buffer_queue_reserve(&queue, min_len, &avail);
+        REQUIRE(avail >= min_len);
+        memcpy(data, "efgh", 4);
+        buffer_queue_commit(&queue, 4);
+
+        buffer_queue_consume(&queue, 1);
+
+        struct iovec iov[4];
+        REQUIRE_EQ(buffer_queue_peek_iov(&queue, iov, 4), 2);
+        REQUIRE_EQ(iov[0].iov_len, 3);
+        REQUIRE(!memcmp(iov[0].iov_base, "bcd", 3));
+        REQUIRE_EQ(iov[1].iov_len, 4);
+        REQUIRE(!memcmp(iov[1].iov_base, "efgh", 4));
+
+        REQUIRE_EQ(buffer_queue_peek_iov(&queue, iov, 1), 1);
+    }
+
+    SUBTEST("shared buffers are queued without copying and left alone") {
+        buffer_queue_consume(&queue, queue.len);
+
+        struct buffer *shared = buffer_create(16);
+        memcpy(shared->data, "frame", 5);
+        shared->len = 5;
+
+        struct buffer_queue other;
+        buffer_queue_create(&other);
+        buffer_queue_append_buffer(&other, shared);
+        buffer_queue_splice(&queue, &other);
+        REQUIRE_EQ(other.len, 0);
+        buffer_queue_append(&queue, "!", 1);
+        REQUIRE_EQ(queue.len, 6);
+        REQUIRE_EQ(shared->len, 5);
+
+        struct iovec iov[4];
+        REQUIRE_EQ(buffer_queue_peek_iov(&queue, iov, 4), 2);
+        REQUIRE_EQ(iov[0].iov_base, shared->data);
+
+        buffer_queue_consume(&queue, 6);
+        REQUIRE_EQ(shared->len, 5);
+        REQUIRE_EQ(atomic_load(&shared->refs), 1);
+
+        buffer_destroy(shared);
+    }
+
+    buffer_queue_destroy(&queue);
+}
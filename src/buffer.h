@@ -0,0 +1,81 @@
+#ifndef SSB_BUFFER_H
+#define SSB_BUFFER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Default capacity of buffers allocated by a queue
+#define BUFFER_CHUNK_SIZE 16384
+
+// Fixed-capacity chunk of bytes. Buffers can be shared between queues without
+// copying them, such as a frame broadcast to every spectator of a game, and
+// aren't written to while they are
+struct buffer {
+    _Atomic unsigned refs;
+    size_t len, cap;
+    char data[];
+};
+
+struct buffer *buffer_create(size_t cap);
+
+// Take another reference to a buffer
+struct buffer *buffer_ref(struct buffer *buffer);
+
+// Drop a reference to a buffer, freeing it once there are none left
+void buffer_destroy(struct buffer *buffer);
+
+// FIFO of bytes waiting to be sent, stored as a ring of chained buffers so
+// that neither appending nor partially consuming it has to move data around
+struct buffer_queue {
+    struct buffer **buffers;
+    size_t head, num_buffers, cap;
+
+    // Bytes of the head buffer that were already consumed
+    size_t offset;
+
+    // Total number of unconsumed bytes
+    size_t len;
+};
+
+void buffer_queue_create(struct buffer_queue *queue);
+
+void buffer_queue_destroy(struct buffer_queue *queue);
+
+// Copy bytes onto the end of the queue
+void buffer_queue_append(struct buffer_queue *queue, char const *data, size_t len);
+
+// Queue a whole buffer without copying it, taking a reference to it
+void buffer_queue_append_buffer(struct buffer_queue *queue, struct buffer *buffer);
+
+// Move everything from one queue onto the end of another, leaving it empty
+void buffer_queue_splice(struct buffer_queue *queue, struct buffer_queue *other);
+
+// Get space for at least min_len bytes at the end of the queue to encode into
+// directly, and how much is actually available. Nothing is queued until it's
+// committed
+char *buffer_queue_reserve(struct buffer_queue *queue, size_t min_len, size_t *len);
+
+// Queue bytes that were written into reserved space
+void buffer_queue_commit(struct buffer_queue *queue, size_t len);
+
+// Get a pointer to the first unconsumed byte and the number of contiguous bytes
+// after it, or NULL if the queue is empty
+char *buffer_queue_peek(struct buffer_queue *queue, size_t *len);
+
+// Fill in up to max_iov vectors covering the unconsumed bytes, for gathering
+// the whole queue into a single writev/sendmsg. Returns the number used
+size_t buffer_queue_peek_iov(struct buffer_queue *queue, struct iovec *iov, size_t max_iov);
+
+// Drop bytes from the front of the queue once they've been sent
+void buffer_queue_consume(struct buffer_queue *queue, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SSB_BUFFER_H
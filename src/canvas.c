@@ -1,17 +1,53 @@
+#include <baro.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
 #include <memory.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "canvas.h"
+#include "diff.h"
+#include "escape.h"
 #include "util.h"
 #include "log.h"
 
+// Hash cells as raw words, two at a time
+static uint64_t hash_cells(uint64_t hash, struct cell const *cells, size_t len) {
+    hash ^= len;
+    size_t i = 0;
+    for (; i + 2 <= len; i += 2) {
+        uint64_t word;
+        memcpy(&word, &cells[i], sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    if (i < len) {
+        uint32_t word;
+        memcpy(&word, &cells[i], sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+// Rehash a row of the front buffer after it's been brought up to date
+static void hash_front_row(struct canvas *canvas, unsigned y) {
+    canvas->front_hashes[y] = hash_cells(y, &canvas->buf[0][(size_t) y * canvas->w], canvas->w);
+}
+
 void canvas_create(struct canvas *canvas, unsigned w, unsigned h) {
     // Allocate the two buffers
     canvas->buf[0] = calloc(w * h, sizeof(struct cell));
     canvas->buf[1] = calloc(w * h, sizeof(struct cell));
     canvas->w = w, canvas->h = h;
 
+    // Everything needs to be sent initially
+    canvas->dirty_rows = calloc((h + CANVAS_DIRTY_BITS - 1) / CANVAS_DIRTY_BITS, sizeof(uint64_t));
+    canvas_mark_dirty(canvas, 0, h);
+    canvas->front_hashes = calloc(h, sizeof(uint64_t));
+
     // Initialize the starting style
     canvas_reset(canvas);
 
@@ -19,6 +55,16 @@ void canvas_create(struct canvas *canvas, unsigned w, unsigned h) {
     canvas->force_flush = canvas->force_next_flush_only = false;
     canvas->flush_index = 0;
     CANVAS_CELL_CLEAR(canvas->flush_state);
+    canvas->flush_state_known = false;
+    canvas->cursor_known = false;
+
+    canvas->features = CANVAS_DEFAULT_FEATURES;
+
+    // Draw to the base layer, with no overlays to composite
+    memset(canvas->layers, 0, sizeof(canvas->layers));
+    canvas->layer = 0;
+    canvas->target = canvas->frame = canvas->buf[1];
+    canvas->composed = NULL;
 
     // For the sake of consistency, all blank cells store spaces
     struct cell empty_cell = canvas->style, space_cell = canvas->style;
@@ -28,12 +74,78 @@ void canvas_create(struct canvas *canvas, unsigned w, unsigned h) {
             canvas->buf[0][x + y * w] = empty_cell;
             canvas->buf[1][x + y * w] = space_cell;
         }
+        hash_front_row(canvas, y);
     }
 }
 
 void canvas_destroy(struct canvas *canvas) {
     free(canvas->buf[0]);
     free(canvas->buf[1]);
+    free(canvas->dirty_rows);
+    free(canvas->front_hashes);
+
+    for (unsigned i = 1; i < CANVAS_MAX_LAYERS; i++) {
+        free(canvas->layers[i].buf);
+    }
+    free(canvas->composed);
+}
+
+void canvas_set_features(struct canvas *canvas, unsigned features) {
+    canvas->features = features;
+}
+
+void canvas_mark_dirty(struct canvas *canvas, unsigned y, unsigned h) {
+    ASSERT(y + h <= canvas->h);
+
+    for (unsigned row = y; row < y + h; row++) {
+        canvas->dirty_rows[row / CANVAS_DIRTY_BITS] |= 1ull << (row % CANVAS_DIRTY_BITS);
+    }
+}
+
+// Note that rows of the selected layer were drawn to. Overlays that are hidden
+// don't affect what gets flushed until they're shown
+static void mark_drawn(struct canvas *canvas, unsigned y, unsigned h) {
+    if (canvas->layer != 0) {
+        struct canvas_layer *layer = &canvas->layers[canvas->layer];
+        if (layer->y0 == layer->y1) {
+            layer->y0 = y, layer->y1 = y + h;
+        }
+        else {
+            layer->y0 = SSB_MIN(layer->y0, y);
+            layer->y1 = SSB_MAX(layer->y1, y + h);
+        }
+
+        if (!layer->visible) {
+            return;
+        }
+    }
+
+    canvas_mark_dirty(canvas, y, h);
+}
+
+// Note that a row of the front buffer caught up with the frame
+static void mark_clean(struct canvas *canvas, unsigned y) {
+    hash_front_row(canvas, y);
+    canvas->dirty_rows[y / CANVAS_DIRTY_BITS] &= ~(1ull << (y % CANVAS_DIRTY_BITS));
+}
+
+// Find the first dirty row at or after y, or h if there are none
+static unsigned next_dirty_row(struct canvas *canvas, unsigned y) {
+    unsigned const num_words = (canvas->h + CANVAS_DIRTY_BITS - 1) / CANVAS_DIRTY_BITS;
+    unsigned word = y / CANVAS_DIRTY_BITS;
+    if (word >= num_words) {
+        return canvas->h;
+    }
+
+    uint64_t bits = canvas->dirty_rows[word] & (~0ull << (y % CANVAS_DIRTY_BITS));
+    while (bits == 0) {
+        if (++word == num_words) {
+            return canvas->h;
+        }
+        bits = canvas->dirty_rows[word];
+    }
+
+    return word * CANVAS_DIRTY_BITS + (unsigned) __builtin_ctzll(bits);
 }
 
 void canvas_resize(struct canvas *canvas, unsigned w, unsigned h) {
@@ -49,14 +161,21 @@ void canvas_resize(struct canvas *canvas, unsigned w, unsigned h) {
     uint16_t const copy_w = (old.w > w) ? w : old.w;
     uint16_t const copy_h = (old.h > h) ? h : old.h;
     for (uint16_t y = 0; y < copy_h; y++) {
-        memcpy(canvas->buf[1], old.buf[1], copy_w * sizeof(struct cell));
+        memcpy(&canvas->buf[1][y * w], &old.buf[1][y * old.w], copy_w * sizeof(struct cell));
+    }
+
+    canvas->features = old.features;
+
+    // Overlays are left empty, since whatever's on them was laid out for the
+    // old size, but keep drawing to the same layer
+    for (unsigned i = 1; i < CANVAS_MAX_LAYERS; i++) {
+        canvas->layers[i].visible = old.layers[i].visible;
     }
+    canvas_select_layer(canvas, old.layer);
 
     // Free the existing canvas
     canvas_destroy(&old);
 
-    // Interrupt the current flush
-    canvas->flush_index = 0;
     canvas_force_next_flush(canvas);
 }
 
@@ -68,99 +187,569 @@ void canvas_erase(struct canvas *canvas) {
 
     for (unsigned y = y1; y < y2; y++) {
         for (unsigned x = x1; x < x2; x++) {
-            canvas->buf[1][x + y * canvas->w] = new_cell;
+            canvas->target[x + y * canvas->w] = new_cell;
         }
     }
+
+    mark_drawn(canvas, y1, y2 - y1);
 }
 
 #define CANVAS_LEN (canvas->w * canvas->h)
 
-bool canvas_flush(struct canvas *canvas, char *buf, size_t len, size_t *len_written) {
-    if (canvas->flush_index == CANVAS_LEN) {
-        if (canvas->force_flush && canvas->force_next_flush_only) {
-            canvas->force_flush = canvas->force_next_flush_only = false;
+// Longest cursor movement we'll consider, which bounds how many unchanged
+// cells are worth re-emitting to step over them
+#define MAX_MOVE_LEN 32
+
+// Encode a code point in the client's character set. Returns its length
+static size_t encode_glyph(struct canvas *canvas, unsigned long code_point, char *glyph) {
+    if (canvas->features & CANVAS_FEATURE_LATIN1) {
+        glyph[0] = code_point <= 0xff ? (char) code_point : '?';
+        return 1;
+    }
+
+    char *glyph_end = glyph;
+    return utf8_encode(code_point, &glyph_end, 4);
+}
+
+// Step the cursor over cells the client already has by printing them again.
+// Only works when they're all in the style the terminal is currently set to
+static size_t encode_reprint(struct canvas *canvas, unsigned from_x, unsigned to_x,
+                             unsigned y, char *buf) {
+    char *p = buf;
+    for (unsigned x = from_x; x < to_x; x++) {
+        struct cell cell = canvas->buf[0][x + y * canvas->w];
+        if (cell.code_point == 0 || !canvas->flush_state_known ||
+                !CANVAS_CELL_STYLE_EQ(cell, canvas->flush_state)) {
+            return SIZE_MAX;
         }
 
-        return false;
+        char glyph[4];
+        size_t const glyph_len = encode_glyph(canvas, cell.code_point, glyph);
+        if (p - buf + glyph_len > MAX_MOVE_LEN) {
+            return SIZE_MAX;
+        }
+        memcpy(p, glyph, glyph_len);
+        p += glyph_len;
     }
+    return (size_t) (p - buf);
+}
 
-    bool early_exit = false;
-    size_t index = canvas->flush_index, last_index = index, remaining = len;
-    while (remaining > 0 && index < CANVAS_LEN) {
-        struct cell prev = canvas->buf[0][index], next = canvas->buf[1][index];
-
-        // Ignore unchanged cells at the cost of a cursor move which may
-        // potentially be longer
-        if (!canvas->force_flush && CANVAS_CELL_EQ(prev, next)) {
-            index++;
-            continue;
+// Keep whichever candidate is shorter
+static void pick_move(char *best, size_t *best_len, char const *candidate, size_t len) {
+    if (len < *best_len) {
+        memcpy(best, candidate, len);
+        *best_len = len;
+    }
+}
+
+// Cheapest way to get from one column to another within row y
+static size_t encode_horizontal_move(struct canvas *canvas, unsigned from_x, unsigned to_x,
+                                     unsigned y, char *buf) {
+    if (from_x == to_x) {
+        return 0;
+    }
+
+    char candidate[2 * MAX_MOVE_LEN + 8];
+    size_t best_len = SIZE_MAX;
+
+    if (to_x > from_x) {
+        pick_move(buf, &best_len, candidate, escape_csi(candidate, to_x - from_x, 'C'));
+        pick_move(buf, &best_len, candidate, encode_reprint(canvas, from_x, to_x, y, candidate));
+    }
+    else {
+        pick_move(buf, &best_len, candidate, escape_csi(candidate, from_x - to_x, 'D'));
+
+        // Carriage return, then move forward from the first column. Without
+        // BINARY, a CR has to be followed by a NUL or LF (RFC 854)
+        candidate[0] = '\r', candidate[1] = '\0';
+        size_t forward_len = to_x == 0 ? 0 : escape_csi(candidate + 2, to_x, 'C');
+        size_t const reprint_len = encode_reprint(canvas, 0, to_x, y, candidate + MAX_MOVE_LEN);
+        if (reprint_len < forward_len) {
+            memcpy(candidate + 2, candidate + MAX_MOVE_LEN, reprint_len);
+            forward_len = reprint_len;
         }
+        pick_move(buf, &best_len, candidate, 2 + forward_len);
+    }
 
-        // There's a chance that part of this message will get cut off. To
-        // reduce complexity, we simply discard the output for an entire cell if
-        // a single part of it won't fit
-        size_t initial_remaining = remaining;
-
-        // Move the cursor explicitly when the previous block wasn't changed or
-        // was on a different line
-        bool noncontinuous = (last_index + 1 != index),
-                newline = (index % canvas->w == 0);
-        if (noncontinuous || newline) {
-            int x = (int) (index % canvas->w), y = (int) (index / canvas->w);
-            int escape_len = snprintf(buf, remaining, "\x1b[%d;%dH", y + 1, x + 1);
-            if (escape_len < 0) {
-                remaining = initial_remaining;
-                break;
+    return best_len;
+}
+
+// Encode the cheapest sequence that moves the cursor to the given cell: an
+// absolute CUP, or when we know where the cursor is, a relative move or
+// reprinting the cells in between
+static size_t encode_move(struct canvas *canvas, unsigned x, unsigned y, char *buf) {
+    char candidate[2 * MAX_MOVE_LEN + 16];
+    size_t best_len = escape_cup(buf, x, y);
+
+    if (!canvas->cursor_known) {
+        return best_len;
+    }
+
+    unsigned const cursor_x = canvas->cursor_x, cursor_y = canvas->cursor_y;
+    if (y == cursor_y) {
+        size_t const len = encode_horizontal_move(canvas, cursor_x, x, y, candidate);
+        pick_move(buf, &best_len, candidate, len);
+    }
+    else if (y > cursor_y) {
+        unsigned const dy = y - cursor_y;
+
+        // Move straight down, keeping the column
+        size_t len = escape_csi(candidate, dy, 'B');
+        len += encode_horizontal_move(canvas, cursor_x, x, y, candidate + len);
+        pick_move(buf, &best_len, candidate, len);
+
+        // Start of a following line. Line feeds can't scroll here, since we
+        // never move below the bottom row
+        if (dy <= MAX_MOVE_LEN / 2) {
+            len = 0;
+            for (unsigned i = 0; i < dy; i++) {
+                candidate[len++] = '\r';
+                candidate[len++] = '\n';
             }
-            else if (escape_len >= remaining) {
-                remaining = initial_remaining;
-                early_exit = true;
-                break;
+            len += encode_horizontal_move(canvas, 0, x, y, candidate + len);
+            pick_move(buf, &best_len, candidate, len);
+        }
+    }
+    else {
+        size_t len = escape_csi(candidate, cursor_y - y, 'A');
+        len += encode_horizontal_move(canvas, cursor_x, x, y, candidate + len);
+        pick_move(buf, &best_len, candidate, len);
+    }
+
+    return best_len;
+}
+
+// Append an SGR parameter, separating it from any before it
+static char *append_sgr_param(char *buf, char *start, unsigned param) {
+    if (buf != start) {
+        *buf++ = ';';
+    }
+    return buf + escape_decimal(buf, param);
+}
+
+// Parameters to get from one set of attributes to another. When from is NULL,
+// starts from the defaults that SGR 0 resets to
+static char *encode_sgr_params(struct cell const *from, struct cell to, char *buf) {
+    char *const start = buf;
+    struct cell defaults = {0};
+    if (from == NULL) {
+        defaults.foreground = defaults.background = default_color;
+        from = &defaults;
+    }
+
+    if (from->bold != to.bold) {
+        buf = append_sgr_param(buf, start, to.bold ? 1 : 22);
+    }
+    if (from->italic != to.italic) {
+        buf = append_sgr_param(buf, start, to.italic ? 3 : 23);
+    }
+    if (from->underline != to.underline) {
+        buf = append_sgr_param(buf, start, to.underline ? 4 : 24);
+    }
+    if (from->blink != to.blink) {
+        buf = append_sgr_param(buf, start, to.blink ? 5 : 25);
+    }
+    if (from->foreground != to.foreground) {
+        buf = append_sgr_param(buf, start, 30 + to.foreground);
+    }
+    if (from->background != to.background) {
+        buf = append_sgr_param(buf, start, 40 + to.background);
+    }
+    return buf;
+}
+
+// Encode the shortest SGR sequence that sets the terminal to a cell's
+// attributes: either changing only the ones that differ from what the terminal
+// has, or resetting everything first. Resetting is the only option when we
+// don't know what the terminal has
+static size_t encode_sgr(struct canvas *canvas, struct cell to, char *buf) {
+    char delta[32], reset[32];
+    size_t delta_len = SIZE_MAX;
+
+    char *p = buf;
+    *p++ = '\x1b';
+    *p++ = '[';
+
+    if (canvas->flush_state_known) {
+        delta_len = (size_t) (encode_sgr_params(&canvas->flush_state, to, delta) - delta);
+    }
+
+    // A bare CSI m resets, but the 0 has to be spelled out when followed by
+    // anything else
+    size_t reset_len = (size_t) (encode_sgr_params(NULL, to, reset + 2) - (reset + 2));
+    if (reset_len > 0) {
+        reset[0] = '0', reset[1] = ';';
+        reset_len += 2;
+    }
+
+    if (delta_len <= reset_len) {
+        memcpy(p, delta, delta_len);
+        p += delta_len;
+    }
+    else {
+        memcpy(p, reset, reset_len);
+        p += reset_len;
+    }
+
+    *p++ = 'm';
+    return (size_t) (p - buf);
+}
+
+// Check if a cell can be produced by erasing it, which blanks cells with the
+// default background and no other visible attributes
+#define IS_ERASABLE(cell) ((cell).code_point == ' ' && (cell).background == default_color && \
+        !(cell).underline)
+
+// Encode the run of identical cells starting at index, if the terminal
+// supports a shorter way to output it than printing each one. Returns the
+// number of cells in the run. Runs that are best printed as is aren't encoded,
+// leaving buf untouched
+static size_t encode_run(struct canvas *canvas, size_t index, size_t row_end, char **buf,
+                         bool *erased) {
+    struct cell const cell = canvas->frame[index];
+    *erased = false;
+
+    char glyph[4];
+    size_t const glyph_len = encode_glyph(canvas, cell.code_point, glyph);
+
+    // Overwriting cells that didn't change with the same contents is harmless,
+    // so the run doesn't stop at unchanged cells
+    size_t run_len = 1;
+    if (canvas->features & CANVAS_RUN_FEATURES) {
+        while (index + run_len < row_end && CANVAS_CELL_EQ(canvas->frame[index + run_len], cell)) {
+            run_len++;
+        }
+    }
+
+    enum {
+        RUN_LITERAL, RUN_REPEAT, RUN_ERASE_CHARS, RUN_ERASE_LINE
+    } method = RUN_LITERAL;
+    size_t best_len = run_len * glyph_len;
+    char scratch[16];
+
+    if (run_len > 1 && (canvas->features & CANVAS_FEATURE_REP)) {
+        size_t const len = glyph_len + escape_csi(scratch, (unsigned) run_len - 1, 'b');
+        if (len < best_len) {
+            method = RUN_REPEAT, best_len = len;
+        }
+    }
+
+    if (IS_ERASABLE(cell)) {
+        bool const to_end = index + run_len == row_end;
+        if (to_end && (canvas->features & CANVAS_FEATURE_EL) && 3 < best_len) {
+            method = RUN_ERASE_LINE, best_len = 3;
+        }
+
+        // Erasing doesn't move the cursor, so count stepping over the run too
+        if (canvas->features & CANVAS_FEATURE_ECH) {
+            size_t len = escape_csi(scratch, (unsigned) run_len, 'X');
+            if (!to_end) {
+                len += escape_csi(scratch, (unsigned) run_len, 'C');
+            }
+            if (len < best_len) {
+                method = RUN_ERASE_CHARS, best_len = len;
             }
+        }
+    }
+
+    switch (method) {
+        case RUN_LITERAL:
+            return run_len;
+
+        case RUN_REPEAT:
+            memcpy(*buf, glyph, glyph_len);
+            *buf += glyph_len;
+            *buf += escape_csi(*buf, (unsigned) run_len - 1, 'b');
+            return run_len;
+
+        case RUN_ERASE_CHARS:
+            *buf += escape_csi(*buf, (unsigned) run_len, 'X');
+            *erased = true;
+            return run_len;
+
+        case RUN_ERASE_LINE:
+            *buf += escape_csi(*buf, 1, 'K');
+            *erased = true;
+            return run_len;
+    }
 
-            buf += escape_len;
-            remaining -= escape_len;
+    return 0;
+}
+
+// Whole cells can only be treated as code points plus attribute bits when the
+// compiler lays out bitfields from the least significant bit up
+#if defined(__SSE2__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CANVAS_SSE2_TEXT
+#endif
+
+// Number of cells from the start that share the first cell's attributes and
+// hold plain ASCII, up to max
+static size_t ascii_span(struct cell const *cells, size_t max) {
+    size_t i = 0;
+#ifdef CANVAS_SSE2_TEXT
+    // A cell qualifies when everything above its low 7 bits matches the
+    // first cell's attributes, with nothing set in the rest of the code point
+    uint32_t first;
+    memcpy(&first, cells, sizeof(first));
+    __m128i const attributes = _mm_set1_epi32((int) (first & ~0xfffffu));
+    __m128i const text_mask = _mm_set1_epi32((int) ~0x7fu);
+    for (; i + 4 <= max; i += 4) {
+        __m128i const words = _mm_loadu_si128((__m128i const *) (cells + i));
+        __m128i const eq = _mm_cmpeq_epi32(_mm_and_si128(words, text_mask), attributes);
+        int const mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        if (mask != 0xf) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+#endif
+    for (; i < max; i++) {
+        if (cells[i].code_point >= 0x80 || !CANVAS_CELL_STYLE_EQ(cells[i], cells[0])) {
+            break;
         }
+    }
+    return i;
+}
 
-        // Emit styling if it's different from the last flushed character
-        if (!CANVAS_CELL_STYLE_EQ(canvas->flush_state, next)) {
-            int escape_len = snprintf(buf, remaining, "\x1b[%d;%dm",
-                                      (int)next.foreground + 30,(int)next.background + 40);
-            if (escape_len < 0) {
-                remaining = initial_remaining;
+// Narrow ASCII cells down to one byte each
+static void narrow_ascii(struct cell const *cells, size_t len, char *out) {
+    size_t i = 0;
+#ifdef CANVAS_SSE2_TEXT
+    __m128i const low_byte = _mm_set1_epi32(0xff);
+    for (; i + 16 <= len; i += 16) {
+        __m128i const a = _mm_and_si128(_mm_loadu_si128((__m128i const *) (cells + i)), low_byte);
+        __m128i const b = _mm_and_si128(_mm_loadu_si128((__m128i const *) (cells + i + 4)), low_byte);
+        __m128i const c = _mm_and_si128(_mm_loadu_si128((__m128i const *) (cells + i + 8)), low_byte);
+        __m128i const d = _mm_and_si128(_mm_loadu_si128((__m128i const *) (cells + i + 12)), low_byte);
+        __m128i const bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128((__m128i *) (out + i), bytes);
+    }
+#endif
+    for (; i < len; i++) {
+        out[i] = (char) cells[i].code_point;
+    }
+}
+
+// Length of the ASCII text starting at index that can be copied out as is.
+// When the canvas can compress runs, the text stops short of any run of
+// identical cells that's long enough to be worth it and that the canvas can
+// actually compress: anything with REP, only blanks with ECH or EL
+static size_t ascii_text_len(struct canvas *canvas, size_t index, size_t end, size_t row_end) {
+    struct cell const *cells = &canvas->frame[index];
+    if (cells[0].code_point >= 0x80) {
+        return 0;
+    }
+
+    size_t len = ascii_span(cells, end - index);
+    bool const repeat = canvas->features & CANVAS_FEATURE_REP;
+    bool const erase = canvas->features & (CANVAS_FEATURE_ECH | CANVAS_FEATURE_EL);
+    if (repeat || erase) {
+        size_t const max = row_end - index;
+        for (size_t i = 0; i < len && i + 3 < max; i++) {
+            if ((repeat || IS_ERASABLE(cells[i])) && CANVAS_CELL_EQ(cells[i], cells[i + 1]) &&
+                    CANVAS_CELL_EQ(cells[i], cells[i + 2]) && CANVAS_CELL_EQ(cells[i], cells[i + 3])) {
+                return i;
             }
-            else if (escape_len >= remaining) {
-                remaining = initial_remaining;
-                early_exit = true;
-                break;
+        }
+    }
+    return len;
+}
+
+void canvas_forget_terminal_state(struct canvas *canvas) {
+    canvas->cursor_known = false;
+    canvas->flush_state_known = false;
+}
+
+// Point the frame at what the client should see: the base layer as is, or with
+// the visible overlays composited over every dirty row if there are any
+static void compose(struct canvas *canvas) {
+    canvas->frame = canvas->buf[1];
+
+    bool any_visible = false;
+    for (unsigned i = 1; i < CANVAS_MAX_LAYERS; i++) {
+        struct canvas_layer const *layer = &canvas->layers[i];
+        any_visible |= (layer->visible && layer->y0 < layer->y1);
+    }
+    if (!any_visible) {
+        return;
+    }
+
+    if (canvas->composed == NULL) {
+        canvas->composed = malloc(CANVAS_LEN * sizeof(struct cell));
+        ASSERT(canvas->composed != NULL);
+    }
+
+    for (unsigned y = 0; (y = next_dirty_row(canvas, y)) < canvas->h; y++) {
+        size_t const row_start = (size_t) y * canvas->w;
+        struct cell *row = &canvas->composed[row_start];
+        memcpy(row, &canvas->buf[1][row_start], canvas->w * sizeof(struct cell));
+
+        for (unsigned i = 1; i < CANVAS_MAX_LAYERS; i++) {
+            struct canvas_layer const *layer = &canvas->layers[i];
+            if (!layer->visible || y < layer->y0 || y >= layer->y1) {
+                continue;
             }
 
-            buf += escape_len;
-            remaining -= escape_len;
+            struct cell const *cells = &layer->buf[row_start];
+            for (unsigned x = 0; x < canvas->w; x++) {
+                if (cells[x].code_point != 0) {
+                    row[x] = cells[x];
+                }
+            }
+        }
+    }
+
+    canvas->frame = canvas->composed;
+}
+
+bool canvas_flush(struct canvas *canvas, char *buf, size_t len, size_t *len_written) {
+    compose(canvas);
+
+    bool early_exit = false;
+    size_t index = canvas->flush_index, remaining = len;
+
+    // Only rows that were written to can differ from what the client has
+    unsigned y = (unsigned) (index / canvas->w);
+    while (remaining > 0 && (y = next_dirty_row(canvas, y)) < canvas->h) {
+        size_t const row_start = (size_t) y * canvas->w, row_end = row_start + canvas->w;
+        if (index < row_start) {
+            index = row_start;
+        }
+
+        // Jump between runs of changed cells, then pick the cheapest way to
+        // get the cursor over the unchanged ones in between
+        uint32_t const *front = (uint32_t const *) canvas->buf[0];
+        uint32_t const *back = (uint32_t const *) canvas->frame;
+        size_t run_end = index;
+        while (remaining > 0 && index < row_end) {
+            if (index >= run_end) {
+                if (canvas->force_flush) {
+                    run_end = row_end;
+                }
+                else if (!diff_next_run(front, back, &index, row_end, &run_end)) {
+                    break;
+                }
+            }
+
+            struct cell next = canvas->frame[index];
+            unsigned const x = (unsigned) (index - row_start);
+
+            // Encode the whole cell up front, so that it's either sent in full
+            // or not at all if the output buffer runs out
+            char cell_buf[2 * MAX_MOVE_LEN + 64];
+            char *p = cell_buf;
+
+            if (!canvas->cursor_known || canvas->cursor_x != x || canvas->cursor_y != y) {
+                p += encode_move(canvas, x, y, p);
+            }
+
+            // Emit styling if it's different from the last flushed character
+            bool const restyle = !canvas->flush_state_known ||
+                    !CANVAS_CELL_STYLE_EQ(canvas->flush_state, next);
+            if (restyle) {
+                p += encode_sgr(canvas, next, p);
+            }
+
+            // Copy plain ASCII text straight through, otherwise encode the
+            // character, or a whole run of them at once
+            size_t const prefix_len = (size_t) (p - cell_buf);
+            size_t run_len = ascii_text_len(canvas, index, run_end, row_end);
+            bool erased = false;
+            if (run_len > 0) {
+                if (prefix_len + 1 > remaining) {
+                    early_exit = true;
+                    break;
+                }
+                run_len = SSB_MIN(run_len, remaining - prefix_len);
+
+                memcpy(buf, cell_buf, prefix_len);
+                narrow_ascii(&canvas->frame[index], run_len, buf + prefix_len);
+                buf += prefix_len + run_len;
+                remaining -= prefix_len + run_len;
+            }
+            else {
+                run_len = encode_run(canvas, index, row_end, &p, &erased);
+
+                // Print runs that weren't encoded, as much of them as fits
+                char glyph[4];
+                size_t glyph_len = 0;
+                if (p == cell_buf + prefix_len) {
+                    glyph_len = encode_glyph(canvas, next.code_point, glyph);
+                }
+
+                size_t const cell_len = (size_t) (p - cell_buf);
+                if (cell_len + glyph_len > remaining) {
+                    early_exit = true;
+                    break;
+                }
+
+                memcpy(buf, cell_buf, cell_len);
+                buf += cell_len;
+                remaining -= cell_len;
+
+                // Unchanged cells are only worth reprinting as part of a
+                // compressed run
+                if (glyph_len > 0) {
+                    run_len = SSB_MIN(SSB_MIN(run_len, run_end - index), remaining / glyph_len);
+                    for (size_t i = 0; i < run_len; i++) {
+                        memcpy(buf, glyph, glyph_len);
+                        buf += glyph_len;
+                    }
+                    remaining -= run_len * glyph_len;
+                }
+            }
 
             // Save the last flushed cell style
-            canvas->flush_state = next;
+            if (restyle) {
+                canvas->flush_state = next;
+                canvas->flush_state_known = true;
+            }
+
+            // Erasing leaves the cursor where it was. Otherwise terminals
+            // differ on where the cursor sits after printing in the last
+            // column, so don't make any assumptions about it
+            canvas->cursor_y = y;
+            if (erased) {
+                canvas->cursor_x = x;
+                canvas->cursor_known = true;
+            }
+            else {
+                canvas->cursor_x = x + (unsigned) run_len;
+                canvas->cursor_known = x + run_len < canvas->w;
+            }
+
+            // Mark the cells as clean
+            memcpy(&canvas->buf[0][index], &canvas->frame[index], run_len * sizeof(struct cell));
+
+            index += run_len;
         }
 
-        // Now try to emit the actual character
-        size_t encoded_len = utf8_encode(next.code_point, &buf, remaining);
-        if (encoded_len > remaining) {
-            remaining = initial_remaining;
-            early_exit = true;
+        // Pick back up in the middle of the row next time
+        if (index < row_end) {
             break;
         }
 
-        remaining -= encoded_len;
+        mark_clean(canvas, y++);
+    }
 
-        // Mark the cell as clean
-        canvas->buf[0][index] = next;
+    *len_written = len - remaining;
+
+    // Every dirty row was flushed, so start from the top next time
+    if (y >= canvas->h) {
+        canvas->flush_index = 0;
 
-        last_index = index++;
+        if (*len_written == 0) {
+            if (canvas->force_flush && canvas->force_next_flush_only) {
+                canvas->force_flush = canvas->force_next_flush_only = false;
+            }
+
+            return false;
+        }
+
+        return true;
     }
 
     canvas->flush_index = index;
 
-    *len_written = len - remaining;
     if (!early_exit && *len_written > 0) {
         return true;
     }
@@ -170,26 +759,196 @@ bool canvas_flush(struct canvas *canvas, char *buf, size_t len, size_t *len_writ
 
 bool canvas_forced_flush(struct canvas *canvas, char *buf, size_t len, size_t *len_written) {
     canvas->force_flush = true;
+    canvas_mark_dirty(canvas, 0, canvas->h);
     bool res = canvas_flush(canvas, buf, len, len_written);
     canvas->force_flush = false;
     return res;
 }
 
+void canvas_resync(struct canvas *canvas) {
+    struct cell blank = {0};
+    blank.code_point = ' ';
+    blank.foreground = blank.background = default_color;
+    for (size_t i = 0; i < CANVAS_LEN; i++) {
+        canvas->buf[0][i] = blank;
+    }
+    for (unsigned y = 0; y < canvas->h; y++) {
+        hash_front_row(canvas, y);
+    }
+
+    // Knowing exactly what the client has beats resending everything
+    canvas->force_flush = canvas->force_next_flush_only = false;
+    canvas->flush_index = 0;
+    canvas_mark_dirty(canvas, 0, canvas->h);
+    canvas_forget_terminal_state(canvas);
+}
+
+bool canvas_is_dirty(struct canvas *canvas) {
+    return next_dirty_row(canvas, 0) < canvas->h;
+}
+
+bool canvas_copy(struct canvas *canvas, unsigned x, unsigned y, struct canvas *src,
+                 unsigned src_x, unsigned src_y, unsigned w, unsigned h) {
+    compose(src);
+
+    // Whatever falls outside either canvas is left out
+    if (x >= canvas->w || y >= canvas->h || src_x >= src->w || src_y >= src->h) {
+        return false;
+    }
+    w = SSB_MIN(w, SSB_MIN(canvas->w - x, src->w - src_x));
+    h = SSB_MIN(h, SSB_MIN(canvas->h - y, src->h - src_y));
+
+    bool changed = false;
+    for (unsigned row = 0; row < h; row++) {
+        // Clean rows of the source are whatever it last flushed
+        unsigned const src_row = src_y + row;
+        uint64_t const bit = 1ull << (src_row % CANVAS_DIRTY_BITS);
+        struct cell const *cells = (src->dirty_rows[src_row / CANVAS_DIRTY_BITS] & bit) ?
+                src->frame : src->buf[0];
+        cells += (size_t) src_row * src->w + src_x;
+
+        struct cell *target = &canvas->target[(size_t) (y + row) * canvas->w + x];
+        if (memcmp(target, cells, w * sizeof(struct cell)) != 0) {
+            memcpy(target, cells, w * sizeof(struct cell));
+            mark_drawn(canvas, y + row, 1);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool canvas_flush_key(struct canvas *canvas, struct canvas_flush_key *key) {
+    if (canvas->force_flush || canvas->flush_index != 0 ||
+            next_dirty_row(canvas, 0) == canvas->h) {
+        return false;
+    }
+
+    compose(canvas);
+
+    // Zeroed first so keys can be compared with memcmp
+    memset(key, 0, sizeof(*key));
+    // Rows that aren't dirty already match the front and aren't sent, so only
+    // the dirty ones (and which ones they are) tell flushes apart
+    uint64_t frame_hash = 0x9e3779b97f4a7c15ull, front_hash = 0x9e3779b97f4a7c15ull;
+    for (unsigned y = 0; (y = next_dirty_row(canvas, y)) < canvas->h; y++) {
+        frame_hash = hash_cells(frame_hash ^ y, &canvas->frame[(size_t) y * canvas->w], canvas->w);
+        front_hash = (front_hash ^ canvas->front_hashes[y]) * 0xff51afd7ed558ccdull;
+        front_hash ^= front_hash >> 32;
+    }
+    key->frame_hash = frame_hash;
+    key->front_hash = front_hash;
+    key->w = canvas->w, key->h = canvas->h;
+    key->features = canvas->features;
+
+    key->cursor_known = canvas->cursor_known;
+    if (canvas->cursor_known) {
+        key->cursor_x = canvas->cursor_x, key->cursor_y = canvas->cursor_y;
+    }
+    key->flush_state_known = canvas->flush_state_known;
+    if (canvas->flush_state_known) {
+        key->flush_state = canvas->flush_state;
+    }
+
+    return true;
+}
+
+void canvas_flush_result(struct canvas *canvas, struct canvas_flush_result *result) {
+    memset(result, 0, sizeof(*result));
+    result->cursor_x = canvas->cursor_x, result->cursor_y = canvas->cursor_y;
+    result->cursor_known = canvas->cursor_known;
+    result->flush_state = canvas->flush_state;
+    result->flush_state_known = canvas->flush_state_known;
+}
+
+void canvas_apply_flush(struct canvas *canvas, struct canvas_flush_result const *result) {
+    compose(canvas);
+
+    for (unsigned y = 0; (y = next_dirty_row(canvas, y)) < canvas->h; y++) {
+        size_t const row_start = (size_t) y * canvas->w;
+        memcpy(&canvas->buf[0][row_start], &canvas->frame[row_start],
+               canvas->w * sizeof(struct cell));
+        mark_clean(canvas, y);
+    }
+    canvas->flush_index = 0;
+
+    canvas->cursor_x = result->cursor_x, canvas->cursor_y = result->cursor_y;
+    canvas->cursor_known = result->cursor_known;
+    canvas->flush_state = result->flush_state;
+    canvas->flush_state_known = result->flush_state_known;
+}
+
+void canvas_select_layer(struct canvas *canvas, unsigned layer) {
+    ASSERT(layer < CANVAS_MAX_LAYERS);
+
+    canvas->layer = layer;
+    if (layer == 0) {
+        canvas->target = canvas->buf[1];
+        return;
+    }
+
+    if (canvas->layers[layer].buf == NULL) {
+        canvas->layers[layer].buf = calloc(CANVAS_LEN, sizeof(struct cell));
+        ASSERT(canvas->layers[layer].buf != NULL);
+    }
+    canvas->target = canvas->layers[layer].buf;
+}
+
+void canvas_show_layer(struct canvas *canvas, unsigned layer, bool visible) {
+    ASSERT(layer > 0 && layer < CANVAS_MAX_LAYERS);
+
+    struct canvas_layer *l = &canvas->layers[layer];
+    if (l->visible == visible) {
+        return;
+    }
+
+    l->visible = visible;
+    if (l->y0 < l->y1) {
+        canvas_mark_dirty(canvas, l->y0, l->y1 - l->y0);
+    }
+}
+
+void canvas_clear_layer(struct canvas *canvas, unsigned layer) {
+    ASSERT(layer > 0 && layer < CANVAS_MAX_LAYERS);
+
+    struct canvas_layer *l = &canvas->layers[layer];
+    if (l->y0 == l->y1) {
+        return;
+    }
+
+    memset(&l->buf[(size_t) l->y0 * canvas->w], 0,
+           (size_t) (l->y1 - l->y0) * canvas->w * sizeof(struct cell));
+    if (l->visible) {
+        canvas_mark_dirty(canvas, l->y0, l->y1 - l->y0);
+    }
+    l->y0 = l->y1 = 0;
+}
+
+void canvas_reset_layers(struct canvas *canvas) {
+    for (unsigned i = 1; i < CANVAS_MAX_LAYERS; i++) {
+        canvas_clear_layer(canvas, i);
+        canvas->layers[i].visible = false;
+    }
+    canvas_select_layer(canvas, 0);
+}
+
 void canvas_force_next_flush(struct canvas *canvas) {
     canvas->force_flush = true;
     canvas->force_next_flush_only = true;
+    canvas_mark_dirty(canvas, 0, canvas->h);
 }
 
 void canvas_write(struct canvas *canvas, unsigned x, unsigned y, char *msg) {
     unsigned len = strlen(msg);
-    ASSERT(y + len <= canvas->w);
+    ASSERT(x + len <= canvas->w);
 
-    struct cell *cell = &canvas->buf[1][x + y * canvas->w];
+    struct cell *cell = &canvas->target[x + y * canvas->w];
     for (unsigned i = 0; i < len; i++, cell++, msg++) {
         struct cell new_cell = canvas->style;
         new_cell.code_point = (uint8_t)*msg;
         *cell = new_cell;
     }
+
+    mark_drawn(canvas, y, 1);
 }
 
 void canvas_write_block(struct canvas *canvas, unsigned x1, unsigned y1, unsigned w,
@@ -199,7 +958,7 @@ void canvas_write_block(struct canvas *canvas, unsigned x1, unsigned y1, unsigne
     ASSERT(strlen(buf) <= w * h);
 
     for (unsigned y = y1; y < y1 + h && *buf != '\0'; y++) {
-        struct cell *cell = &canvas->buf[1][x1 + y * canvas->w];
+        struct cell *cell = &canvas->target[x1 + y * canvas->w];
         for (unsigned x = x1; x < x1 + w && *buf != '\0'; x++, buf++, cell++) {
             struct cell new_cell = canvas->style;
             new_cell.code_point = (uint8_t)*buf;
@@ -207,7 +966,7 @@ void canvas_write_block(struct canvas *canvas, unsigned x1, unsigned y1, unsigne
         }
     }
 
-    canvas->flush_index = 0;
+    mark_drawn(canvas, y1, h);
 }
 
 void canvas_write_utf8(struct canvas *canvas, unsigned x, unsigned y, char *msg) {
@@ -225,21 +984,41 @@ void canvas_write_utf8(struct canvas *canvas, unsigned x, unsigned y, char *msg)
      */
 }
 
-void canvas_write_block_utf32(struct canvas *canvas, unsigned x1, unsigned y1, unsigned w,
-                              unsigned h, uint32_t *buf, size_t len) {
+void canvas_blit_utf32(struct canvas *canvas, unsigned x1, unsigned y1, unsigned w, unsigned h,
+                       uint32_t const *buf, struct canvas_palette const *palette) {
     ASSERT(x1 + w <= canvas->w);
     ASSERT(y1 + h <= canvas->h);
 
+    struct cell const style = canvas->style;
     for (unsigned y = y1; y < y1 + h; y++) {
-        struct cell *cell = &canvas->buf[1][x1 + y * canvas->w];
+        struct cell *cell = &canvas->target[x1 + y * canvas->w];
         for (unsigned x = x1; x < x1 + w; x++, buf++, cell++) {
-            struct cell new_cell = canvas->style;
-            new_cell.code_point = *buf;
-            *cell = new_cell;
+            uint32_t const c = *buf;
+            if (palette != NULL && c > 0 && c < CANVAS_PALETTE_SIZE &&
+                    palette->cells[c].code_point == c) {
+                *cell = palette->cells[c];
+            }
+            else {
+                struct cell new_cell = style;
+                new_cell.code_point = c;
+                *cell = new_cell;
+            }
         }
     }
 
-    canvas->flush_index = 0;
+    mark_drawn(canvas, y1, h);
+}
+
+void canvas_palette_set(struct canvas_palette *palette, unsigned long c, enum color foreground,
+                        enum color background) {
+    ASSERT(c > 0 && c < CANVAS_PALETTE_SIZE);
+
+    struct cell cell = {0};
+    CANVAS_CELL_CLEAR(cell);
+    cell.code_point = c;
+    cell.foreground = foreground;
+    cell.background = background;
+    palette->cells[c] = cell;
 }
 
 void canvas_put(struct canvas *canvas, unsigned x, unsigned y, unsigned long c) {
@@ -248,13 +1027,13 @@ void canvas_put(struct canvas *canvas, unsigned x, unsigned y, unsigned long c)
 
     struct cell new_cell = canvas->style;
     new_cell.code_point = c;
-    canvas->buf[1][x + y * canvas->w] = new_cell;
+    canvas->target[x + y * canvas->w] = new_cell;
 
-    canvas->flush_index = 0;
+    mark_drawn(canvas, y, 1);
 }
 
 unsigned long canvas_get(struct canvas *canvas, unsigned x, unsigned y) {
-    return canvas->buf[1][x + y * canvas->w].code_point;
+    return canvas->target[x + y * canvas->w].code_point;
 }
 
 void canvas_fill(struct canvas *canvas, unsigned x, unsigned y, unsigned w, unsigned h,
@@ -267,11 +1046,11 @@ void canvas_fill(struct canvas *canvas, unsigned x, unsigned y, unsigned w, unsi
 
     for (unsigned row = y; row < y + h; row++) {
         for (unsigned col = x; col < x + w; col++) {
-            canvas->buf[1][col + row * canvas->w] = new_cell;
+            canvas->target[col + row * canvas->w] = new_cell;
         }
     }
 
-    canvas->flush_index = 0;
+    mark_drawn(canvas, y, h);
 }
 
 void canvas_rect(struct canvas *canvas, unsigned x, unsigned y, unsigned w, unsigned h,
@@ -285,11 +1064,11 @@ void canvas_rect(struct canvas *canvas, unsigned x, unsigned y, unsigned w, unsi
     for (unsigned row = y; row < y + h; row++) {
         unsigned const step = (row == y || row == y + h - 1 || w == 1) ? 1 : w - 1;
         for (unsigned col = x; col < x + w; col += step) {
-            canvas->buf[1][col + row * canvas->w] = new_cell;
+            canvas->target[col + row * canvas->w] = new_cell;
         }
     }
 
-    canvas->flush_index = 0;
+    mark_drawn(canvas, y, h);
 }
 
 void canvas_line(struct canvas *canvas, unsigned x0, unsigned y0, unsigned x1, unsigned y1,
@@ -313,7 +1092,7 @@ void canvas_line(struct canvas *canvas, unsigned x0, unsigned y0, unsigned x1, u
     int y = (int)y0;
     int error = dx + dy;
     for (;;) {
-        canvas->buf[1][x + y * canvas->w] = new_cell;
+        canvas->target[x + y * canvas->w] = new_cell;
         if (x == x1 && y == y1) {
             break;
         }
@@ -335,26 +1114,28 @@ void canvas_line(struct canvas *canvas, unsigned x0, unsigned y0, unsigned x1, u
         }
     }
 
-    canvas->flush_index = 0;
+    mark_drawn(canvas, SSB_MIN(y0, y1), (unsigned) abs((int)y0 - (int)y1) + 1);
 }
 
 void canvas_reset(struct canvas *canvas) {
+    // Cells are diffed as raw words, so padding bits must be zeroed too
+    canvas->style = (struct cell){0};
     CANVAS_CELL_CLEAR(canvas->style);
     canvas->style.background = default_color;
     canvas->style.foreground = default_color;
 }
 
-//void canvas_italic(struct canvas *canvas, bool state) {
-//    canvas->style.italic = state ? true : false;
-//}
-//
-//void canvas_underline(struct canvas *canvas, bool state) {
-//    canvas->style.underline = state ? true : false;
-//}
-//
-//void canvas_blink(struct canvas *canvas, bool state) {
-//    canvas->style.blink = state ? true : false;
-//}
+void canvas_italic(struct canvas *canvas, bool state) {
+    canvas->style.italic = state ? true : false;
+}
+
+void canvas_underline(struct canvas *canvas, bool state) {
+    canvas->style.underline = state ? true : false;
+}
+
+void canvas_blink(struct canvas *canvas, bool state) {
+    canvas->style.blink = state ? true : false;
+}
 
 void canvas_bold(struct canvas *canvas, bool state) {
     canvas->style.bold = state ? true : false;
@@ -367,3 +1148,259 @@ void canvas_foreground(struct canvas *canvas, enum color color) {
 void canvas_background(struct canvas *canvas, enum color color) {
     canvas->style.background = color;
 }
+
+TEST("[canvas] canvas_flush") {
+    struct canvas canvas;
+    canvas_create(&canvas, 4, 3);
+
+    // Runs are covered separately below
+    canvas_set_features(&canvas, 0);
+
+    char buf[256];
+    size_t len;
+
+    SUBTEST("everything is sent initially") {
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        REQUIRE_EQ(len, 33);
+        REQUIRE_FALSE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+    }
+
+    SUBTEST("only changed cells are sent") {
+        canvas_put(&canvas, 2, 1, 'x');
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[2;3Hx");
+        REQUIRE_FALSE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+    }
+
+    SUBTEST("rewriting identical contents sends nothing") {
+        canvas_erase(&canvas);
+        canvas_put(&canvas, 2, 1, 'x');
+        REQUIRE_FALSE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        REQUIRE_EQ(canvas.dirty_rows[0], 0);
+    }
+
+    SUBTEST("interrupted flushes resume mid-row") {
+        canvas_write(&canvas, 0, 2, "abcd");
+        REQUIRE(canvas_flush(&canvas, buf, 3, &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\r\na");
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "bcd");
+        REQUIRE_FALSE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+    }
+
+    SUBTEST("the cursor takes the cheapest path") {
+        // Reprinting the unchanged space beats any escape sequence
+        canvas_put(&canvas, 0, 0, 'p');
+        canvas_put(&canvas, 2, 0, 'q');
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[1;1Hp q");
+
+        canvas_put(&canvas, 1, 1, 'r');
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\r\n r");
+
+        canvas_put(&canvas, 0, 1, 's');
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        REQUIRE_EQ(len, sizeof("\r\0s") - 1);
+        REQUIRE(!memcmp(buf, "\r\0s", len));
+
+        canvas_put(&canvas, 3, 1, 't');
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "rxt");
+    }
+
+    SUBTEST("only changed attributes are sent") {
+        canvas_foreground(&canvas, red);
+        canvas_put(&canvas, 0, 0, 'a');
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[1;1H\x1b[31ma");
+
+        canvas_bold(&canvas, true);
+        canvas_underline(&canvas, true);
+        canvas_put(&canvas, 1, 0, 'b');
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[1;4mb");
+
+        // Resetting is shorter than turning each attribute back off
+        canvas_reset(&canvas);
+        canvas_put(&canvas, 2, 0, 'c');
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[mc");
+
+        // Nothing is assumed about attributes after raw output
+        canvas_forget_terminal_state(&canvas);
+        canvas_background(&canvas, blue);
+        canvas_put(&canvas, 3, 0, 'd');
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[1;4H\x1b[0;44md");
+        canvas_reset(&canvas);
+    }
+
+    SUBTEST("runs of identical cells are compressed") {
+        struct canvas wide;
+        canvas_create(&wide, 20, 2);
+        canvas_set_features(&wide, CANVAS_FEATURE_REP | CANVAS_FEATURE_ECH | CANVAS_FEATURE_EL);
+
+        REQUIRE(canvas_flush(&wide, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[1;1H\x1b[m\x1b[K\r\n\x1b[K");
+        REQUIRE_FALSE(canvas_flush(&wide, buf, sizeof(buf), &len));
+
+        canvas_put(&wide, 15, 0, 'x');
+        REQUIRE(canvas_flush(&wide, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[1;16Hx");
+
+        canvas_fill(&wide, 2, 0, 10, 1, '#');
+        REQUIRE(canvas_flush(&wide, buf, sizeof(buf), &len));
+        REQUIRE_EQ(len, sizeof("\r\0  #\x1b[9b") - 1);
+        REQUIRE(!memcmp(buf, "\r\0  #\x1b[9b", len));
+
+        canvas_fill(&wide, 2, 0, 10, 1, ' ');
+        REQUIRE(canvas_flush(&wide, buf, sizeof(buf), &len));
+        REQUIRE_EQ(len, sizeof("\r\0   \x1b[12b") - 1);
+        REQUIRE(!memcmp(buf, "\r\0   \x1b[12b", len));
+
+        canvas_set_features(&wide, CANVAS_FEATURE_ECH | CANVAS_FEATURE_EL);
+        canvas_fill(&wide, 2, 0, 10, 1, '#');
+        canvas_flush(&wide, buf, sizeof(buf), &len);
+        canvas_fill(&wide, 2, 0, 10, 1, ' ');
+        REQUIRE(canvas_flush(&wide, buf, sizeof(buf), &len));
+        REQUIRE_EQ(len, sizeof("\r\0  \x1b[13X") - 1);
+        REQUIRE(!memcmp(buf, "\r\0  \x1b[13X", len));
+
+        // Runs that don't compress go out whole, or as much as fits
+        canvas_fill(&wide, 2, 0, 10, 1, 0x2588);
+        REQUIRE(canvas_flush(&wide, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\xe2\x96\x88\xe2\x96\x88\xe2\x96\x88\xe2\x96\x88\xe2\x96\x88"
+                            "\xe2\x96\x88\xe2\x96\x88\xe2\x96\x88\xe2\x96\x88\xe2\x96\x88");
+
+        canvas_fill(&wide, 2, 0, 10, 1, 0x2592);
+        REQUIRE(canvas_flush(&wide, buf, 16, &len));
+        REQUIRE_EQ(len, 16);
+        REQUIRE(!memcmp(buf, "\r\0  \xe2\x96\x92\xe2\x96\x92\xe2\x96\x92\xe2\x96\x92", len));
+        REQUIRE(canvas_flush(&wide, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\xe2\x96\x92\xe2\x96\x92\xe2\x96\x92\xe2\x96\x92\xe2\x96\x92\xe2\x96\x92");
+
+        canvas_destroy(&wide);
+    }
+
+    SUBTEST("text is copied through in batches") {
+        struct canvas wide;
+        canvas_create(&wide, 40, 1);
+        canvas_set_features(&wide, 0);
+
+        canvas_write(&wide, 0, 0, "the quick brown fox jumps over the lazy");
+        canvas_put(&wide, 3, 0, 0xa3);
+        canvas_bold(&wide, true);
+        canvas_write(&wide, 20, 0, "JUMPS");
+        REQUIRE(canvas_flush(&wide, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[1;1H\x1b[mthe\xc2\xa3quick brown fox \x1b[1mJUMPS\x1b[m over the lazy ");
+
+        // Clients without UTF-8 get Latin-1 instead
+        canvas_set_features(&wide, CANVAS_FEATURE_LATIN1);
+        canvas_put(&wide, 3, 0, ' ');
+        canvas_flush(&wide, buf, sizeof(buf), &len);
+        canvas_put(&wide, 3, 0, 0xa3);
+        canvas_put(&wide, 4, 0, 0x2588);
+        REQUIRE(canvas_flush(&wide, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[D\xa3?");
+
+        canvas_destroy(&wide);
+    }
+
+    canvas_destroy(&canvas);
+}
+
+TEST("[canvas] layers") {
+    struct canvas canvas;
+    canvas_create(&canvas, 4, 3);
+    canvas_set_features(&canvas, 0);
+
+    char buf[256];
+    size_t len;
+
+    canvas_write(&canvas, 0, 1, "abcd");
+    REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+
+    SUBTEST("hidden layers aren't flushed") {
+        canvas_select_layer(&canvas, 1);
+        canvas_put(&canvas, 1, 1, 'x');
+        canvas_select_layer(&canvas, 0);
+        REQUIRE_FALSE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+    }
+
+    SUBTEST("showing a layer sends only the cells it covers") {
+        canvas_show_layer(&canvas, 1, true);
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[2;2Hx");
+    }
+
+    SUBTEST("drawing under a visible layer doesn't show through") {
+        canvas_put(&canvas, 1, 1, 'y');
+        REQUIRE_FALSE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+
+        canvas_put(&canvas, 2, 1, 'z');
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "z");
+    }
+
+    SUBTEST("hiding a layer restores what's underneath") {
+        canvas_show_layer(&canvas, 1, false);
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        REQUIRE_EQ(len, sizeof("\r\0ay") - 1);
+        REQUIRE(!memcmp(buf, "\r\0ay", len));
+    }
+
+    SUBTEST("clearing a visible layer makes it transparent") {
+        canvas_show_layer(&canvas, 1, true);
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+
+        canvas_clear_layer(&canvas, 1);
+        REQUIRE(canvas_flush(&canvas, buf, sizeof(buf), &len));
+        buf[len] = '\0';
+        REQUIRE_STR_EQ(buf, "\x1b[Dy");
+    }
+
+    canvas_destroy(&canvas);
+}
+
+TEST("[canvas] canvas_blit_utf32") {
+    struct canvas canvas;
+    canvas_create(&canvas, 4, 1);
+
+    struct canvas_palette palette = {0};
+    canvas_palette_set(&palette, 'E', white, green);
+    canvas_palette_set(&palette, 0xa3, white, green);
+
+    canvas_foreground(&canvas, red);
+    uint32_t const field[4] = {'E', 'x', 0xa3, 0x263a};
+    canvas_blit_utf32(&canvas, 0, 0, 4, 1, field, &palette);
+
+    REQUIRE_EQ(canvas.buf[1][0].code_point, 'E');
+    REQUIRE_EQ(canvas.buf[1][0].foreground, white);
+    REQUIRE_EQ(canvas.buf[1][0].background, green);
+    REQUIRE_EQ(canvas.buf[1][1].foreground, red);
+    REQUIRE_EQ(canvas.buf[1][1].background, default_color);
+    REQUIRE_EQ(canvas.buf[1][2].background, green);
+    REQUIRE_EQ(canvas.buf[1][3].code_point, 0x263a);
+    REQUIRE_EQ(canvas.buf[1][3].foreground, red);
+
+    canvas_destroy(&canvas);
+}
@@ -23,11 +23,13 @@ enum color {
     default_color = 9,
 };
 
+// Code points are limited to 20 bits to make room for every attribute, which
+// leaves out plane 16 (supplementary private use area B)
 struct cell {
-    uint32_t code_point : 21;
-//    uint32_t italic : 1;
-//    uint32_t underline : 1;
-//    uint32_t blink : 1;
+    uint32_t code_point : 20;
+    uint32_t italic : 1;
+    uint32_t underline : 1;
+    uint32_t blink : 1;
     enum color foreground : 4;
     enum color background : 4;
     uint32_t bold : 1;
@@ -37,27 +39,124 @@ _Static_assert(sizeof(struct cell) == sizeof(uint32_t),
         "Canvas cell should fit in 32 bits");
 
 // Zero out a cell
-#define CANVAS_CELL_CLEAR(cell) do { (cell).code_point = 0; /*(cell).italic = false;*/ \
-        /*(cell).underline = false; (cell).blink = false;*/ (cell).foreground = black; \
+#define CANVAS_CELL_CLEAR(cell) do { (cell).code_point = 0; (cell).italic = false; \
+        (cell).underline = false; (cell).blink = false; (cell).foreground = black; \
         (cell).background = black; (cell).bold = false; } while (0)
 
-#define CANVAS_CELL_STYLE_EQ(a, b) (/*(a).italic == (b).italic &&*/ \
-    /*(a).underline == (b).underline && (a).blink == (b).blink &&*/ (a).bold == (b).bold && \
+#define CANVAS_CELL_STYLE_EQ(a, b) ((a).italic == (b).italic && \
+    (a).underline == (b).underline && (a).blink == (b).blink && (a).bold == (b).bold && \
     (a).foreground == (b).foreground && (a).background == (b).background)
 
 // Check if two cells are equivalent
 #define CANVAS_CELL_EQ(a, b) ((a).code_point == (b).code_point && CANVAS_CELL_STYLE_EQ((a), (b)))
 
+// Optional control sequences the canvas may use to shorten its output
+enum canvas_feature {
+    // Repeat the preceding character (REP)
+    CANVAS_FEATURE_REP = 1 << 0,
+    // Erase characters (ECH)
+    CANVAS_FEATURE_ECH = 1 << 1,
+    // Erase to the end of the line (EL)
+    CANVAS_FEATURE_EL = 1 << 2,
+    // Send characters as single Latin-1 bytes instead of UTF-8, for clients
+    // that don't speak it. Anything past U+00FF comes out as '?'
+    CANVAS_FEATURE_LATIN1 = 1 << 3,
+};
+
+// Features that shorten runs of identical cells
+#define CANVAS_RUN_FEATURES (CANVAS_FEATURE_REP | CANVAS_FEATURE_ECH | CANVAS_FEATURE_EL)
+
+// ECH and EL go back to the VT220 and VT100, so nearly every client has
+// them. REP is only known to work once the client identifies itself
+#define CANVAS_DEFAULT_FEATURES (CANVAS_FEATURE_ECH | CANVAS_FEATURE_EL)
+
+// Number of rows tracked by each word of the dirty bitmap
+#define CANVAS_DIRTY_BITS 64
+
+// Code points that can be given their own style when blitting
+#define CANVAS_PALETTE_SIZE 256
+
+// Styles to blit code points in, indexed by code point. Entries that don't
+// hold their own code point (including all of a zeroed palette) leave the
+// code point in the canvas's current style
+struct canvas_palette {
+    struct cell cells[CANVAS_PALETTE_SIZE];
+};
+
+// Number of layers, counting the base layer (0) that's drawn to by default
+#define CANVAS_MAX_LAYERS 4
+
+// An overlay drawn over the base layer, such as a dialog box. Overlays are
+// composited when the canvas is flushed, so showing or hiding one only
+// dirties the rows it covers and leaves what's underneath intact
+struct canvas_layer {
+    // Allocated the first time the layer is selected. Cells with a code point
+    // of zero are transparent
+    struct cell *buf;
+    bool visible;
+
+    // Rows that were drawn to since the layer was last cleared
+    unsigned y0, y1;
+};
+
 struct canvas {
     struct cell *buf[2];
     unsigned w, h;
 
+    // Bitmap of rows written to since they were last flushed. Rows that aren't
+    // marked are known to match what the client has
+    uint64_t *dirty_rows;
+    // Hash of each row of buf[0], updated as rows are flushed
+    uint64_t *front_hashes;
+
     struct cell style;
 
+    // Overlays, drawn in order over the base layer in buf[1]. The first entry
+    // stands for the base layer and is never allocated
+    struct canvas_layer layers[CANVAS_MAX_LAYERS];
+    // Layer the drawing functions write to, and its cells
+    unsigned layer;
+    struct cell *target;
+    // What the current flush diffs against buf[0]: buf[1] itself, or a copy of
+    // it with the visible overlays composited over it
+    struct cell *frame;
+    struct cell *composed;
+
     bool force_flush;
     bool force_next_flush_only;
+    // Where an interrupted flush picks back up
     size_t flush_index;
+    // Attributes the client's terminal is set to, if known
+    struct cell flush_state;
+    bool flush_state_known;
+
+    // Where the client's cursor is after everything flushed so far, if known
+    unsigned cursor_x, cursor_y;
+    bool cursor_known;
+
+    // Bitmask of canvas_feature that the client supports
+    unsigned features;
+};
+
+// Everything the output of a canvas' next flush depends on. Canvases with
+// equal keys produce the same bytes, so they can share a single encoding
+struct canvas_flush_key {
+    // Hashes of the dirty rows and of what the client has now
+    uint64_t frame_hash, front_hash;
+    unsigned w, h, features;
+
+    unsigned cursor_x, cursor_y;
+    bool cursor_known;
     struct cell flush_state;
+    bool flush_state_known;
+};
+
+// Where a flush leaves the client's terminal
+struct canvas_flush_result {
+    unsigned cursor_x, cursor_y;
+    bool cursor_known;
+    struct cell flush_state;
+    bool flush_state_known;
 };
 
 void canvas_create(struct canvas *canvas, unsigned w, unsigned h);
@@ -72,13 +171,66 @@ bool canvas_flush(struct canvas *canvas, char *buf, size_t len, size_t *len_writ
 
 void canvas_force_next_flush(struct canvas *canvas);
 
+// Check if anything was drawn since the last flush
+bool canvas_is_dirty(struct canvas *canvas);
+
+// Draw a w by h block of what another canvas shows, starting from (src_x,
+// src_y), onto this one at (x, y). Only rows that end up different need to be
+// flushed. Returns whether there were any
+bool canvas_copy(struct canvas *canvas, unsigned x, unsigned y, struct canvas *src,
+                 unsigned src_x, unsigned src_y, unsigned w, unsigned h);
+
+// Fingerprint the flush the canvas has pending. Returns false if there's
+// nothing to flush, or if the flush can't be shared because it's forced or
+// was interrupted partway through
+bool canvas_flush_key(struct canvas *canvas, struct canvas_flush_key *key);
+
+// Save where the last complete flush left the terminal
+void canvas_flush_result(struct canvas *canvas, struct canvas_flush_result *result);
+
+// Bring the canvas up to date without encoding anything, because the output
+// of a flush by another canvas with the same key was sent in its place
+void canvas_apply_flush(struct canvas *canvas, struct canvas_flush_result const *result);
+
+// Start over from a blank screen after the client's terminal was cleared, so
+// the next flush redraws everything that isn't blank
+void canvas_resync(struct canvas *canvas);
+
+void canvas_set_features(struct canvas *canvas, unsigned features);
+
+// Direct the drawing functions to a layer, where 0 is the base layer and the
+// rest are overlays that start out transparent and hidden
+void canvas_select_layer(struct canvas *canvas, unsigned layer);
+
+// Show or hide an overlay. Only the rows it was drawn on need to be flushed
+void canvas_show_layer(struct canvas *canvas, unsigned layer, bool visible);
+
+// Make an overlay fully transparent again
+void canvas_clear_layer(struct canvas *canvas, unsigned layer);
+
+// Hide and clear every overlay, and go back to drawing on the base layer
+void canvas_reset_layers(struct canvas *canvas);
+
+// Make the next flush position the cursor absolutely and reset the attributes,
+// for when something other than the canvas may have changed them
+void canvas_forget_terminal_state(struct canvas *canvas);
+
+// Flag rows as needing to be compared on the next flush
+void canvas_mark_dirty(struct canvas *canvas, unsigned y, unsigned h);
+
 void canvas_write(struct canvas *canvas, unsigned x, unsigned y, char *msg);
 
 void canvas_write_block(struct canvas *canvas, unsigned x1, unsigned y1, unsigned w,
                         unsigned h, char *buf);
 
-void canvas_write_block_utf32(struct canvas *canvas, unsigned x1, unsigned y1, unsigned w,
-                              unsigned h, uint32_t *buf, size_t len);
+// Write a block of code points in a single pass, styling each one from the
+// palette if it has an entry for it (or the current style if palette is NULL)
+void canvas_blit_utf32(struct canvas *canvas, unsigned x1, unsigned y1, unsigned w, unsigned h,
+                       uint32_t const *buf, struct canvas_palette const *palette);
+
+// Blit a code point in the given colors from now on
+void canvas_palette_set(struct canvas_palette *palette, unsigned long c, enum color foreground,
+                        enum color background);
 
 void canvas_put(struct canvas *canvas, unsigned x, unsigned y, unsigned long c);
 
@@ -93,11 +245,11 @@ void canvas_line(struct canvas *canvas, unsigned x0, unsigned y0, unsigned x1, u
 
 void canvas_reset(struct canvas *canvas);
 
-//void canvas_italic(struct canvas *canvas, bool state);
-//
-//void canvas_underline(struct canvas *canvas, bool state);
-//
-//void canvas_blink(struct canvas *canvas, bool state);
+void canvas_italic(struct canvas *canvas, bool state);
+
+void canvas_underline(struct canvas *canvas, bool state);
+
+void canvas_blink(struct canvas *canvas, bool state);
 
 void canvas_bold(struct canvas *canvas, bool state);
 
@@ -479,6 +479,10 @@ bool db_create(struct db *db, char *path, char *levels_path) {
         return false;
     }
 
+    // Worker threads each have their own connection, so wait out each other's
+    // write locks instead of failing with SQLITE_BUSY
+    sqlite3_busy_timeout(db->db, 1000);
+
     if (!migrate(db->db, levels_path)) {
         LOG_ERROR("Database migration failed");
 
@@ -0,0 +1,148 @@
+#include <baro.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIFF_X86
+#endif
+#include "diff.h"
+
+// Canvas cells are bitfield structs, so words are loaded with memcpy (or
+// vector loads, which may alias anything) rather than dereferenced directly
+static inline uint32_t load_word(uint32_t const *buf, size_t i) {
+    uint32_t word;
+    memcpy(&word, buf + i, sizeof(word));
+    return word;
+}
+
+static size_t scan_scalar(uint32_t const *a, uint32_t const *b, size_t i, size_t end,
+                          bool find_change) {
+    while (i < end && (load_word(a, i) != load_word(b, i)) != find_change) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef DIFF_X86
+// SSE2 is part of the x86-64 baseline, so this needs no runtime check there
+__attribute__((target("sse2")))
+static size_t scan_sse2(uint32_t const *a, uint32_t const *b, size_t i, size_t end,
+                        bool find_change) {
+    // Mask of the lanes we're looking for: equal lanes compare as all ones
+    int const flip = find_change ? 0xf : 0;
+    for (; i + 4 <= end; i += 4) {
+        __m128i const eq = _mm_cmpeq_epi32(_mm_loadu_si128((__m128i const *) (a + i)),
+                                           _mm_loadu_si128((__m128i const *) (b + i)));
+        int const mask = _mm_movemask_ps(_mm_castsi128_ps(eq)) ^ flip;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return scan_scalar(a, b, i, end, find_change);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(uint32_t const *a, uint32_t const *b, size_t i, size_t end,
+                        bool find_change) {
+    // Two vectors per iteration, so a mostly unchanged 80-column row takes five
+    unsigned const flip = find_change ? 0xffff : 0;
+    for (; i + 16 <= end; i += 16) {
+        __m256i const eq0 = _mm256_cmpeq_epi32(_mm256_loadu_si256((__m256i const *) (a + i)),
+                                               _mm256_loadu_si256((__m256i const *) (b + i)));
+        __m256i const eq1 = _mm256_cmpeq_epi32(_mm256_loadu_si256((__m256i const *) (a + i + 8)),
+                                               _mm256_loadu_si256((__m256i const *) (b + i + 8)));
+        unsigned const mask = ((unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(eq0)) |
+                               (unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(eq1)) << 8) ^ flip;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return scan_sse2(a, b, i, end, find_change);
+}
+#endif
+
+static size_t scan(uint32_t const *a, uint32_t const *b, size_t i, size_t end, bool find_change) {
+#ifdef DIFF_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_avx2(a, b, i, end, find_change);
+    }
+    return scan_sse2(a, b, i, end, find_change);
+#else
+    return scan_scalar(a, b, i, end, find_change);
+#endif
+}
+
+size_t diff_first_change(uint32_t const *a, uint32_t const *b, size_t start, size_t end) {
+    return scan(a, b, start, end, true);
+}
+
+size_t diff_first_match(uint32_t const *a, uint32_t const *b, size_t start, size_t end) {
+    return scan(a, b, start, end, false);
+}
+
+bool diff_next_run(uint32_t const *a, uint32_t const *b, size_t *start, size_t end,
+                   size_t *run_end) {
+    *start = diff_first_change(a, b, *start, end);
+    if (*start == end) {
+        return false;
+    }
+
+    *run_end = diff_first_match(a, b, *start + 1, end);
+    return true;
+}
+
+TEST("[diff] diff_next_run") {
+    uint32_t a[100], b[100];
+    for (uint32_t i = 0; i < 100; i++) {
+        a[i] = b[i] = i * 2654435761u;
+    }
+
+    size_t start = 0, run_end = 0;
+
+    SUBTEST("equal buffers have no runs") {
+        REQUIRE_FALSE(diff_next_run(a, b, &start, 100, &run_end));
+        REQUIRE_EQ(start, 100);
+    }
+
+    SUBTEST("runs are found in every lane position") {
+        b[3] ^= 1;
+        b[17] ^= 1u << 31;
+        b[18] ^= 1;
+        b[19] ^= 1;
+        b[99] ^= 1;
+
+        start = 0;
+        REQUIRE(diff_next_run(a, b, &start, 100, &run_end));
+        REQUIRE_EQ(start, 3);
+        REQUIRE_EQ(run_end, 4);
+
+        start = run_end;
+        REQUIRE(diff_next_run(a, b, &start, 100, &run_end));
+        REQUIRE_EQ(start, 17);
+        REQUIRE_EQ(run_end, 20);
+
+        start = run_end;
+        REQUIRE(diff_next_run(a, b, &start, 100, &run_end));
+        REQUIRE_EQ(start, 99);
+        REQUIRE_EQ(run_end, 100);
+
+        start = run_end;
+        REQUIRE_FALSE(diff_next_run(a, b, &start, 100, &run_end));
+    }
+
+    SUBTEST("scans stay within their bounds") {
+        REQUIRE_EQ(diff_first_change(a, b, 4, 17), 17);
+        REQUIRE_EQ(diff_first_change(a, b, 18, 19), 18);
+        REQUIRE_EQ(diff_first_match(a, b, 17, 19), 19);
+    }
+
+    SUBTEST("vector and scalar scans agree") {
+        for (size_t i = 0; i < 100; i++) {
+            b[i] = (i % 7 == 0 || i % 11 == 0) ? ~a[i] : a[i];
+        }
+
+        for (size_t s = 0; s < 100; s++) {
+            REQUIRE_EQ(diff_first_change(a, b, s, 100), scan_scalar(a, b, s, 100, true));
+            REQUIRE_EQ(diff_first_match(a, b, s, 100), scan_scalar(a, b, s, 100, false));
+        }
+    }
+}
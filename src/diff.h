@@ -0,0 +1,31 @@
+#ifndef SSB_DIFF_H
+#define SSB_DIFF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Find the next run of differing words between two buffers within [*start,
+// end), comparing them as raw 32-bit values several at a time. On success,
+// *start is moved to the first differing word and *run_end to the first equal
+// word after it (or end). Returns false if there are no differences left
+bool diff_next_run(uint32_t const *a, uint32_t const *b, size_t *start, size_t end,
+                   size_t *run_end);
+
+// Index of the first word in [start, end) that differs between the buffers,
+// or end if they're equal
+size_t diff_first_change(uint32_t const *a, uint32_t const *b, size_t start, size_t end);
+
+// Index of the first word in [start, end) that matches between the buffers,
+// or end if every word differs
+size_t diff_first_match(uint32_t const *a, uint32_t const *b, size_t start, size_t end);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SSB_DIFF_H
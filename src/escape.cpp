@@ -0,0 +1,123 @@
+#include <array>
+#include <cstring>
+#include <string_view>
+#include "escape.h"
+
+// Escape sequences are looked up from tables built at compile time, so that
+// encoding one is a memcpy or two instead of a trip through printf
+
+namespace {
+
+struct sequence {
+    char bytes[8];
+    unsigned char len;
+
+    [[nodiscard]] constexpr std::string_view view() const {
+        return {bytes, len};
+    }
+};
+
+constexpr void append(sequence &seq, char c) {
+    seq.bytes[seq.len++] = c;
+}
+
+constexpr void append_decimal(sequence &seq, unsigned n) {
+    char digits[3] = {};
+    unsigned num_digits = 0;
+    do {
+        digits[num_digits++] = static_cast<char>('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+
+    while (num_digits > 0) {
+        append(seq, digits[--num_digits]);
+    }
+}
+
+template<typename F>
+constexpr std::array<sequence, ESCAPE_TABLE_SIZE> make_table(F f) {
+    std::array<sequence, ESCAPE_TABLE_SIZE> table{};
+    for (unsigned i = 0; i < ESCAPE_TABLE_SIZE; i++) {
+        f(table[i], i);
+    }
+    return table;
+}
+
+// "n"
+constexpr auto decimals = make_table([](sequence &seq, unsigned n) {
+    append_decimal(seq, n);
+});
+
+// "CSI row;" for each zero-based row
+constexpr auto cup_rows = make_table([](sequence &seq, unsigned y) {
+    append(seq, '\x1b');
+    append(seq, '[');
+    append_decimal(seq, y + 1);
+    append(seq, ';');
+});
+
+// "colH" for each zero-based column
+constexpr auto cup_columns = make_table([](sequence &seq, unsigned x) {
+    append_decimal(seq, x + 1);
+    append(seq, 'H');
+});
+
+static_assert(decimals[0].view() == "0");
+static_assert(decimals[49].view() == "49");
+static_assert(decimals[ESCAPE_TABLE_SIZE - 1].view() == "255");
+static_assert(cup_rows[0].view() == "\x1b[1;");
+static_assert(cup_rows[199].view() == "\x1b[200;");
+static_assert(cup_columns[79].view() == "80H");
+
+size_t copy(char *buf, sequence const &seq) {
+    std::memcpy(buf, seq.bytes, seq.len);
+    return seq.len;
+}
+
+}
+
+extern "C" size_t escape_decimal(char *buf, unsigned n) {
+    if (n < ESCAPE_TABLE_SIZE) {
+        return copy(buf, decimals[n]);
+    }
+
+    // Out of range of the table, which no canvas should ever need
+    char digits[10];
+    size_t num_digits = 0;
+    do {
+        digits[num_digits++] = static_cast<char>('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+
+    for (size_t i = 0; i < num_digits; i++) {
+        buf[i] = digits[num_digits - 1 - i];
+    }
+    return num_digits;
+}
+
+extern "C" size_t escape_csi(char *buf, unsigned n, char final) {
+    char *p = buf;
+    *p++ = '\x1b';
+    *p++ = '[';
+    if (n != 1) {
+        p += escape_decimal(p, n);
+    }
+    *p++ = final;
+    return static_cast<size_t>(p - buf);
+}
+
+extern "C" size_t escape_cup(char *buf, unsigned x, unsigned y) {
+    if (x < ESCAPE_TABLE_SIZE && y < ESCAPE_TABLE_SIZE) {
+        size_t const len = copy(buf, cup_rows[y]);
+        return len + copy(buf + len, cup_columns[x]);
+    }
+
+    char *p = buf;
+    *p++ = '\x1b';
+    *p++ = '[';
+    p += escape_decimal(p, y + 1);
+    *p++ = ';';
+    p += escape_decimal(p, x + 1);
+    *p++ = 'H';
+    return static_cast<size_t>(p - buf);
+}
@@ -0,0 +1,32 @@
+#ifndef SSB_ESCAPE_H
+#define SSB_ESCAPE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+// Numbers below this are looked up in precomputed tables. It covers every
+// coordinate and count on the largest canvas a client can negotiate (200x200)
+// as well as every SGR parameter
+#define ESCAPE_TABLE_SIZE 256
+
+// Longest sequence any of these functions can produce
+#define ESCAPE_MAX_LEN 24
+
+// Write a number in decimal. Returns the number of bytes written
+size_t escape_decimal(char *buf, unsigned n);
+
+// Write a CSI sequence with a single numeric parameter, which is left out when
+// it's the default of 1 (e.g. CUF, CUD, ECH, REP)
+size_t escape_csi(char *buf, unsigned n, char final);
+
+// Write a cursor position (CUP) sequence for a zero-based cell
+size_t escape_cup(char *buf, unsigned x, unsigned y);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SSB_ESCAPE_H
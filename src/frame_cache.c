@@ -0,0 +1,107 @@
+#include <baro.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frame_cache.h"
+#include "log.h"
+
+void frame_cache_create(struct frame_cache *cache) {
+    *cache = (struct frame_cache){0};
+}
+
+void frame_cache_destroy(struct frame_cache *cache) {
+    for (size_t i = 0; i < FRAME_CACHE_SIZE; i++) {
+        free(cache->frames[i].data);
+    }
+
+    *cache = (struct frame_cache){0};
+}
+
+static struct frame *slot(struct frame_cache *cache, struct canvas_flush_key const *key) {
+    return &cache->frames[(key->frame_hash ^ key->front_hash) % FRAME_CACHE_SIZE];
+}
+
+struct frame const *frame_cache_get(struct frame_cache *cache, struct canvas_flush_key const *key) {
+    struct frame *frame = slot(cache, key);
+    if (frame->data == NULL || memcmp(&frame->key, key, sizeof(*key)) != 0) {
+        cache->num_misses++;
+        return NULL;
+    }
+
+    cache->num_hits++;
+    return frame;
+}
+
+struct frame const *frame_cache_encode(struct frame_cache *cache, struct canvas *canvas,
+                                       struct canvas_flush_key const *key) {
+    struct frame *frame = slot(cache, key);
+    free(frame->data);
+    *frame = (struct frame){.key = *key};
+
+    // Grow the frame until the whole flush fits
+    size_t cap = 0, len;
+    do {
+        if (cap - frame->len < FRAME_CACHE_MIN_ENCODE_LEN) {
+            cap = cap ? cap * 2 : FRAME_CACHE_MIN_ENCODE_LEN;
+            frame->data = realloc(frame->data, cap);
+            ASSERT(frame->data != NULL);
+        }
+
+        if (!canvas_flush(canvas, frame->data + frame->len, cap - frame->len, &len)) {
+            break;
+        }
+        frame->len += len;
+    } while (len > 0);
+
+    canvas_flush_result(canvas, &frame->result);
+    return frame;
+}
+
+TEST("[frame_cache] frame_cache") {
+    struct frame_cache cache;
+    frame_cache_create(&cache);
+
+    struct canvas a, b;
+    canvas_create(&a, 8, 2);
+    canvas_create(&b, 8, 2);
+    canvas_write(&a, 0, 0, "shared");
+    canvas_write(&b, 0, 0, "shared");
+
+    struct canvas_flush_key key_a, key_b;
+    char buf[256];
+    size_t len;
+
+    SUBTEST("canvases in the same state share a frame") {
+        REQUIRE(canvas_flush_key(&a, &key_a));
+        REQUIRE_EQ(frame_cache_get(&cache, &key_a), NULL);
+        struct frame const *frame = frame_cache_encode(&cache, &a, &key_a);
+        REQUIRE(frame->len > 0);
+        REQUIRE_FALSE(canvas_flush(&a, buf, sizeof(buf), &len));
+
+        REQUIRE(canvas_flush_key(&b, &key_b));
+        REQUIRE_EQ(frame_cache_get(&cache, &key_b), frame);
+        canvas_apply_flush(&b, &frame->result);
+        REQUIRE_FALSE(canvas_flush(&b, buf, sizeof(buf), &len));
+    }
+
+    SUBTEST("clean canvases have nothing to share") {
+        REQUIRE_FALSE(canvas_flush_key(&a, &key_a));
+    }
+
+    SUBTEST("diverging canvases get their own frames") {
+        canvas_put(&a, 7, 1, 'a');
+        canvas_put(&b, 7, 1, 'b');
+        REQUIRE(canvas_flush_key(&a, &key_a));
+        REQUIRE(canvas_flush_key(&b, &key_b));
+        REQUIRE(memcmp(&key_a, &key_b, sizeof(key_a)) != 0);
+
+        // Shared frames pick up where they left off the same way a flush does
+        struct frame const *frame = frame_cache_encode(&cache, &b, &key_b);
+        size_t const frame_len = frame->len;
+        REQUIRE(canvas_flush(&a, buf, sizeof(buf), &len));
+        REQUIRE_EQ(len, frame_len);
+    }
+
+    canvas_destroy(&a);
+    canvas_destroy(&b);
+    frame_cache_destroy(&cache);
+}
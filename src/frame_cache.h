@@ -0,0 +1,53 @@
+#ifndef SSB_FRAME_CACHE_H
+#define SSB_FRAME_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "canvas.h"
+
+// Number of encoded frames kept around. The cache is direct-mapped, so a
+// frame evicts whichever one was in its slot
+#define FRAME_CACHE_SIZE 64
+
+// Smallest amount of space a frame is encoded into at a time
+#define FRAME_CACHE_MIN_ENCODE_LEN 4096
+
+// A canvas flush, encoded once and sent to every session that needs it
+struct frame {
+    struct canvas_flush_key key;
+    struct canvas_flush_result result;
+
+    char *data;
+    size_t len;
+};
+
+// Encoded frames shared between sessions whose canvases are in the same state,
+// such as everyone sitting on the title screen or watching the same replay.
+// Each server has its own, so it's never touched by more than one thread
+struct frame_cache {
+    struct frame frames[FRAME_CACHE_SIZE];
+
+    size_t num_hits, num_misses;
+};
+
+void frame_cache_create(struct frame_cache *cache);
+
+void frame_cache_destroy(struct frame_cache *cache);
+
+// Find the frame encoded for a canvas with the given key, or NULL if there
+// isn't one
+struct frame const *frame_cache_get(struct frame_cache *cache, struct canvas_flush_key const *key);
+
+// Flush the canvas into a new frame stored under its key
+struct frame const *frame_cache_encode(struct frame_cache *cache, struct canvas *canvas,
+                                       struct canvas_flush_key const *key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SSB_FRAME_CACHE_H
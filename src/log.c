@@ -35,8 +35,8 @@ static const char *level_colors[6] = {
         [LOG_LEVEL_FATAL] = "\x1b[40m\x1b[37m", // Black background, white foreground
 };
 
-// ID of the currently executing session
-_Atomic uint64_t ctx_session_id = 0;
+// ID of the session currently executing on this thread
+_Thread_local uint64_t ctx_session_id = 0;
 
 // Handle to current log file
 _Atomic FILE *log_file = 0;
@@ -66,12 +66,15 @@ static void print_log_line(FILE *f, struct log_line *log_line) {
         snprintf(ctx_info, sizeof(ctx_info), " (#%llu)", ctx_session_id);
     }
 
+    // Keep lines from different threads from interleaving
+    flockfile(f);
     fprintf(f, "%s %s%s\x1b[0m \x1b[90m%s:%d:%s%s:\x1b[0m ",
             buf, level_colors[log_line->level], level_strings[log_line->level],
             log_line->file, log_line->line, log_line->func, ctx_info);
     vfprintf(f, log_line->format, log_line->ap);
     fprintf(f, "\n");
     fflush(f);
+    funlockfile(f);
 }
 
 void log_printf(enum log_level level, char const *file, int line, char const *func, char const *format, ...) {
@@ -80,8 +83,9 @@ void log_printf(enum log_level level, char const *file, int line, char const *fu
     }
 
     time_t const t = time(NULL);
+    struct tm tm;
     struct log_line log_line = {
-            .time = gmtime(&t),
+            .time = gmtime_r(&t, &tm),
             .level = level,
 
             .file = file,
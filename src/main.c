@@ -1,3 +1,8 @@
+// For pthread_setaffinity_np
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,12 +10,19 @@
 #include <fcntl.h>
 #include <termios.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 #include "env.h"
 #include "db.h"
 #include "server.h"
+#include "session.h"
+#include "timer.h"
 #include "log.h"
 
-#define USAGE "usage: ssb [-hvs] [-d path/to/db] [-p port]\n"
+#define USAGE "usage: ssb [-hvsc] [-d path/to/db] [-p port] [-t threads] [-z level] [-w bits]\n"
 #define VERSION "0.1"
 
 #define DEFAULT_PORT "23"
@@ -21,9 +33,9 @@ struct termios orig_termios;
 
 volatile sig_atomic_t running = true;
 
+// Only touches the flag, since it may interrupt any worker thread mid-log
 void handle_signal(int signal_num) {
-    if (signal_num == SIGKILL) {
-        LOG_INFO("Got SIGKILL");
+    if (signal_num == SIGTERM) {
         running = false;
     }
 }
@@ -72,13 +84,22 @@ int run_standalone(struct db *db) {
     state_create(&state);
 
     while (running) {
+        // Sleep until there's input or the next tick is due
+        uint64_t now = timer_now();
+        int timeout_ms = 0;
+        if (state.next_update > now) {
+            timeout_ms = (int) ((state.next_update - now + 999999) / 1000000);
+        }
+        struct pollfd stdin_fd = {.fd = STDIN_FILENO, .events = POLLIN};
+        poll(&stdin_fd, 1, timeout_ms);
+
         char buf[512];
         ssize_t read_len;
         while ((read_len = read(STDIN_FILENO, buf, 512)) > 0) {
             terminal_parse(&state.terminal, buf, read_len);
         }
 
-        if (!state_update(&state, &env)) {
+        if (!state_update(&state, &env, timer_now())) {
             running = false;
         }
 
@@ -97,6 +118,45 @@ int run_standalone(struct db *db) {
     return EXIT_SUCCESS;
 }
 
+// Read and parse everything that's waiting on the session's socket. Returns
+// false if the connection was closed
+static bool receive_session_input(struct session *session) {
+    bool alive;
+    char buf[512];
+    size_t len;
+    while ((alive = session_receive(session, buf, 512, &len)) && len > 0) {
+        terminal_parse(&session->state->terminal, buf, len);
+    }
+    return alive;
+}
+
+// Update a session's state and send whatever it drew, then schedule its next
+// update or disconnect it if it's done
+static void update_session(struct server *server, struct env *env, struct session *session,
+                           uint64_t now) {
+    // Try to update the state
+    bool keep_alive = state_update(session->state, env, now);
+
+    // Drop frames for a client that can't keep up instead of queueing
+    // every one of them. The next frame we do send is diffed against
+    // what the client last got, so it catches up in one go
+    if (!session_is_behind(session)) {
+        session_encode(session, &server->frames);
+    }
+
+    // Send output data, even when we're about to close the connection
+    if (!server_flush_session(server, session)) {
+        keep_alive = false;
+    }
+
+    if (keep_alive) {
+        server_schedule_session(server, session);
+    }
+    else {
+        server_disconnect_session(server, session);
+    }
+}
+
 int run_server(struct db *db, char *service) {
     // Launch the server
     struct server server;
@@ -108,40 +168,41 @@ int run_server(struct db *db, char *service) {
 
     struct env env = {.db=db, .server=&server};
 
-    // Accept new connections and update existing ones
+    // Sleep until there's socket activity or the next session tick is due
     while (running && server_update(&server)) {
-        // Update each session
+        // Handle sessions with pending input
         struct session *session = NULL;
-        while (server_next_session(&server, &session)) {
+        unsigned flags;
+        while (server_next_event(&server, &session, &flags)) {
             log_push_context(session->id);
 
-            // Poll the connection for data and parse it
-            bool alive;
-            char buf[512];
-            size_t len;
-            while ((alive = session_receive(session, buf, 512, &len)) && len > 0) {
-                terminal_parse(&session->state->terminal, buf, len);
+            bool alive = true;
+            if (flags & (SERVER_EVENT_READABLE | SERVER_EVENT_CLOSED)) {
+                alive = receive_session_input(session);
             }
-
-            // Try to update the state
-            bool const keep_alive = state_update(session->state, &env);
-
-            if (alive) {
-                // Flush and send output data if we're alive, even when we're
-                // about to close the connection
-                while (terminal_flush(&session->state->terminal, buf, 512, &len)) {
-                    session_send(session, buf, len);
-                }
+            // The client drained some of its backlog, so keep sending
+            if (alive && (flags & SERVER_EVENT_WRITABLE)) {
+                alive = server_flush_session(&server, session);
             }
-            // The connection was already disconnected or should be disconnected
-            if (!alive || !keep_alive) {
-                // Store the previous session, so we don't break the iterator
-                struct session *prev = session->prev;
-                // Kill the connection
+            if (!alive) {
                 server_disconnect_session(&server, session);
-                session = prev;
             }
+            // Menus answer key presses right away instead of on the next tick
+            else {
+                uint64_t const now = timer_now();
+                if (state_wants_update(session->state, now)) {
+                    update_session(&server, &env, session, now);
+                }
+            }
+
+            log_pop_context();
+        }
 
+        // Update each session whose tick is due
+        uint64_t const now = timer_now();
+        while (server_next_due_session(&server, now, &session)) {
+            log_push_context(session->id);
+            update_session(&server, &env, session, now);
             log_pop_context();
         }
     }
@@ -153,15 +214,102 @@ int run_server(struct db *db, char *service) {
     return EXIT_SUCCESS;
 }
 
+// A server thread with its own listening socket, event loop, sessions and
+// database connection. The kernel spreads incoming connections between the
+// workers' sockets with SO_REUSEPORT
+struct worker {
+    pthread_t thread;
+    int index;
+
+    char *service;
+    char *db_path;
+    // Core to pin the thread to, or -1 to let the scheduler decide
+    int cpu;
+
+    int rc;
+};
+
+static void *run_worker(void *data) {
+    struct worker *worker = data;
+
+    if (worker->cpu >= 0) {
+#ifdef __linux__
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        int result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (result) {
+            LOG_WARN("Failed to pin worker %d to CPU %d (%d: %s)",
+                     worker->index, worker->cpu, result, strerror(result));
+        }
+#else
+        LOG_WARN("Pinning worker threads isn't supported on this platform");
+#endif
+    }
+
+    // The main thread already migrated the database, so this just connects
+    struct db db;
+    if (!db_create(&db, worker->db_path, NULL)) {
+        LOG_ERROR("Failed to open DB for worker %d", worker->index);
+        worker->rc = EXIT_FAILURE;
+        return NULL;
+    }
+
+    LOG_INFO("Worker %d started", worker->index);
+    worker->rc = run_server(&db, worker->service);
+
+    db_destroy(&db);
+    return NULL;
+}
+
+int run_workers(char *db_path, char *service, int num_threads, bool pin_threads) {
+    struct worker *workers = calloc(num_threads, sizeof(struct worker));
+
+    long const num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int num_started = 0;
+    for (; num_started < num_threads; num_started++) {
+        struct worker *worker = &workers[num_started];
+        *worker = (struct worker){
+                .index = num_started,
+                .service = service,
+                .db_path = db_path,
+                .cpu = pin_threads && num_cpus > 0 ? (int) (num_started % num_cpus) : -1,
+        };
+
+        int result = pthread_create(&worker->thread, NULL, run_worker, worker);
+        if (result) {
+            LOG_ERROR("pthread_create failed (%d: %s)", result, strerror(result));
+            running = false;
+            break;
+        }
+    }
+
+    int rc = num_started == num_threads ? EXIT_SUCCESS : EXIT_FAILURE;
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].rc != EXIT_SUCCESS) {
+            rc = workers[i].rc;
+        }
+    }
+
+    free(workers);
+    return rc;
+}
+
 int main(int argc, char *argv[]) {
     char *port = DEFAULT_PORT;
     char *db_path = DEFAULT_DB_PATH;
     char *levels_path = DEFAULT_LEVEL_PATH;
     bool standalone = false;
+    int num_threads = 0;
+    bool pin_threads = false;
+    int compress_level = SESSION_DEFAULT_COMPRESS_LEVEL;
+    int compress_window_bits = SESSION_DEFAULT_COMPRESS_WINDOW_BITS;
 
     // Parse command-line arguments
     int opt;
-    while ((opt = getopt(argc, argv, "hvd:l:p:s")) != -1) {
+    while ((opt = getopt(argc, argv, "hvd:l:p:st:cz:w:")) != -1) {
         switch (opt) {
             case 'd': {
                 db_path = optarg;
@@ -182,6 +330,37 @@ int main(int argc, char *argv[]) {
                 standalone = true;
                 break;
 
+            case 't': {
+                num_threads = atoi(optarg);
+                if (num_threads < 1) {
+                    fprintf(stderr, "Number of threads must be at least 1\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+
+            case 'c':
+                pin_threads = true;
+                break;
+
+            case 'z': {
+                compress_level = atoi(optarg);
+                if (compress_level < 0 || compress_level > 9) {
+                    fprintf(stderr, "Compression level must be between 0 and 9\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+
+            case 'w': {
+                compress_window_bits = atoi(optarg);
+                if (compress_window_bits < 9 || compress_window_bits > 15) {
+                    fprintf(stderr, "Compression window bits must be between 9 and 15\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+
             case 'h': {
                 printf("ssb (sans serif bros) " VERSION " - a Telnet platformer\n"
                 USAGE
@@ -189,6 +368,10 @@ int main(int argc, char *argv[]) {
                 "    -l path         Path of levels to load for new databases (default: \"" DEFAULT_LEVEL_PATH "\")\n"
                 "    -p port         Server port number or name (default: \"" DEFAULT_PORT "\")\n"
                 "    -s              Disable the server and play locally only\n"
+                "    -t threads      Run the server on multiple worker threads\n"
+                "    -c              Pin each worker thread to its own CPU core\n"
+                "    -z level        MCCP2 compression level, or 0 to disable it (default: 6)\n"
+                "    -w bits         MCCP2 window size as a power of two, from 9 to 15 (default: 12)\n"
                 "    -h              Show this help message\n"
                 "    -v              Show the version\n");
                 return EXIT_SUCCESS;
@@ -214,6 +397,11 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
+    if (standalone && num_threads) {
+        LOG_ERROR("Threads cannot be specified in standalone mode");
+        return EXIT_FAILURE;
+    }
+
     // Load the level metadata
     struct db db;
     if (!db_create(&db, db_path, levels_path)) {
@@ -227,8 +415,17 @@ int main(int argc, char *argv[]) {
     action.sa_handler = handle_signal;
     sigaction(SIGTERM, &action, NULL);
 
-    LOG_INFO("Running in %s mode", standalone ? "standalone" : "server");
-    int rc = standalone ? run_standalone(&db) : run_server(&db, port);
+    session_set_compression(compress_level, compress_window_bits);
+
+    int rc;
+    if (num_threads) {
+        LOG_INFO("Running in server mode with %d worker threads", num_threads);
+        rc = run_workers(db_path, port, num_threads, pin_threads);
+    }
+    else {
+        LOG_INFO("Running in %s mode", standalone ? "standalone" : "server");
+        rc = standalone ? run_standalone(&db) : run_server(&db, port);
+    }
 
     LOG_INFO("Closing database");
     db_destroy(&db);
@@ -13,6 +13,12 @@ struct state;
 struct screen_impl {
     void (*destroy)(void *screen, struct state *state);
     bool (*update)(void *screen, struct state *state, struct env *env);
+
+    // Screens that only change when a key is pressed (like menus) set this to
+    // how many ticks they can go without an update. They're then updated as
+    // soon as input arrives instead of on the next tick, and otherwise left
+    // alone. Left at 0, the screen is updated on every tick
+    unsigned idle_ticks;
 };
 
 struct screen {
@@ -2,20 +2,35 @@
 #include "../state.h"
 #include "../db.h"
 #include "../screen.h"
+#include "../stream.h"
 #include "game.h"
 #include "log.h"
 
 struct screen_impl game_screen_impl = {
+        .destroy = game_screen_destroy,
         .update = game_screen_update
 };
 
+// Directions are taken one per tick, so a burst of them plays out over the
+// next few ticks. Ones left waiting longer than this many ticks (like the
+// backlog of a held-down key) are dropped instead of moving the player
+// long after the key was let go
+#define MAX_INPUT_LAG_TICKS 3
+
 struct game_screen_state {
     uint32_t level_id;
     struct game game;
+    struct canvas_palette palette;
 
     enum game_state last_game_state;
 
     int transition_ticks;
+
+    // What's currently on the canvas, so ticks where nothing moved draw nothing
+    uint32_t drawn_tick;
+    bool drawn_prompt;
+    bool drawn_color;
+    size_t drawn_input_log_len;
 };
 
 struct screen *game_screen_create(struct env *env, uint32_t level_id) {
@@ -27,6 +42,7 @@ struct screen *game_screen_create(struct env *env, uint32_t level_id) {
             .transition_ticks = -1,
     };
     screen->impl = &game_screen_impl;
+    game_screen_palette(&((struct game_screen_state *)screen->data)->palette);
 
     // Load the level from the database
     char *field = NULL;
@@ -45,11 +61,69 @@ struct screen *game_screen_create(struct env *env, uint32_t level_id) {
     return screen;
 }
 
+void game_screen_palette(struct canvas_palette *palette) {
+    *palette = (struct canvas_palette){0};
+
+    canvas_palette_set(palette, 'I', white, blue);
+
+    canvas_palette_set(palette, 0xa3, white, green);
+    canvas_palette_set(palette, 'E', white, green);
+
+    canvas_palette_set(palette, '[', white, red);
+    canvas_palette_set(palette, ']', white, red);
+    canvas_palette_set(palette, '{', white, red);
+    canvas_palette_set(palette, '}', white, red);
+    canvas_palette_set(palette, 'X', white, red);
+    canvas_palette_set(palette, '%', white, red);
+}
+
+void game_screen_draw_prompt(struct canvas *canvas, struct game *game, unsigned x_offset,
+                             unsigned y_offset) {
+    struct cell const style = canvas->style;
+    canvas_select_layer(canvas, GAME_SCREEN_PROMPT_LAYER);
+    canvas_clear_layer(canvas, GAME_SCREEN_PROMPT_LAYER);
+
+    if (game->die) {
+        canvas_foreground(canvas, red);
+        canvas_background(canvas, black);
+
+        canvas_fill(canvas, x_offset + 29, y_offset + 9, 22, 7, ' ');
+        canvas_rect(canvas, x_offset + 30, y_offset + 10, 20, 5, '#');
+        canvas_write(canvas, x_offset + 32, y_offset + 12, "press R to retry");
+    }
+    else if (game->win) {
+        canvas_foreground(canvas, green);
+        canvas_background(canvas, black);
+
+        canvas_fill(canvas, x_offset + 26, y_offset + 9, 29, 7, ' ');
+        canvas_rect(canvas, x_offset + 27, y_offset + 10, 27, 5, '#');
+        canvas_write(canvas, x_offset + 29, y_offset + 12, "press space to continue");
+    }
+
+    canvas_select_layer(canvas, 0);
+    canvas->style = style;
+}
+
+void game_screen_destroy(void *data, struct state *state) {
+    if (state->stream != NULL) {
+        stream_close(state->stream);
+        state->stream = NULL;
+    }
+}
+
 bool game_screen_update(void *data, struct state *state, struct env *env) {
     struct game_screen_state *screen = data;
 
+    // Let everyone else on the server watch
+    if (state->stream == NULL && env->server != NULL) {
+        state->stream = stream_open(COLUMNS, ROWS);
+    }
+
     canvas_reset(&state->canvas);
-    canvas_erase(&state->canvas);
+    if (state->redraw) {
+        canvas_erase(&state->canvas);
+        screen->drawn_input_log_len = 0;
+    }
 
     // Allow flashes of color during transitions
     bool color = true;
@@ -118,8 +192,11 @@ bool game_screen_update(void *data, struct state *state, struct env *env) {
         canvas_background(&state->canvas, green);
     }
 
+    uint64_t const max_lag_ns = MAX_INPUT_LAG_TICKS * (uint64_t) state->tick_ms * 1000000ull;
+    uint64_t const since = state->tick_time > max_lag_ns ? state->tick_time - max_lag_ns : 0;
+
     struct directional_input input;
-    terminal_get_directional_input(&state->terminal, &input, false);
+    terminal_next_direction(&state->terminal, &input, false, since);
 
     enum game_state game_state = game_update(&screen->game, &input);
     if (game_state != screen->last_game_state) {
@@ -140,6 +217,27 @@ bool game_screen_update(void *data, struct state *state, struct env *env) {
 
     KEYBOARD_CLEAR(state->terminal.keyboard);
 
+    unsigned int const x_offset = (state->canvas.w - COLUMNS) / 2;
+    unsigned int const y_offset = (state->canvas.h - ROWS) / 2;
+
+    // Blink the prompt once the game is over
+    bool const game_over = screen->game.win || screen->game.die;
+    if (game_over != screen->drawn_prompt || (game_over && state->redraw)) {
+        game_screen_draw_prompt(&state->canvas, &screen->game, x_offset, y_offset);
+        screen->drawn_prompt = game_over;
+    }
+    canvas_show_layer(&state->canvas, GAME_SCREEN_PROMPT_LAYER,
+                      game_over && state->num_ticks % 20 < 10);
+
+    // The field stops changing once the game is over, so there's nothing left
+    // to draw until it starts over
+    if (!state->redraw && color && screen->drawn_color &&
+        screen->game.tick == screen->drawn_tick) {
+        return true;
+    }
+    screen->drawn_tick = screen->game.tick;
+    screen->drawn_color = color;
+
     // Color based on the current state
     if (color && game_state == GAME_STATE_WON) {
         canvas_foreground(&state->canvas, black);
@@ -154,63 +252,11 @@ bool game_screen_update(void *data, struct state *state, struct env *env) {
         canvas_background(&state->canvas, default_color);
     }
 
-    // Draw the game field in the center of the canvas
-    unsigned int const x_offset = (state->canvas.w - COLUMNS) / 2;
-    unsigned int const y_offset = (state->canvas.h - ROWS) / 2;
-    canvas_write_block_utf32(&state->canvas, x_offset, y_offset, COLUMNS, ROWS,
-                             (uint32_t *) screen->game.field, ROWS * COLUMNS);
-
-    // Color individual cells
-    if (color && game_state == GAME_STATE_IN_PROGRESS) {
-        for (unsigned y = 0; y < ROWS; y++) {
-            for (unsigned x = 0; x < COLUMNS; x++) {
-                unsigned long ch = screen->game.field[y][x];
-                switch (ch) {
-                    case 'I':
-                        canvas_foreground(&state->canvas, white);
-                        canvas_background(&state->canvas, blue);
-                        break;
-
-                    case 0xa3:
-                    case 'E':
-                        canvas_foreground(&state->canvas, white);
-                        canvas_background(&state->canvas, green);
-                        break;
-
-                    case '[':
-                    case ']':
-                    case '{':
-                    case '}':
-                    case 'X':
-                    case '%':
-                        canvas_foreground(&state->canvas, white);
-                        canvas_background(&state->canvas, red);
-                        break;
-
-                    default: continue;
-                }
-                canvas_put(&state->canvas, x_offset + x, y_offset + y, ch);
-            }
-        }
-    }
-
-    // Draw instructions
-    if (screen->game.die && state->num_ticks % 20 < 10) {
-        canvas_foreground(&state->canvas, red);
-        canvas_background(&state->canvas, black);
-
-        canvas_fill(&state->canvas, x_offset + 29, y_offset + 9, 22, 7, ' ');
-        canvas_rect(&state->canvas, x_offset + 30, y_offset + 10, 20, 5, '#');
-        canvas_write(&state->canvas, x_offset + 32, y_offset + 12, "press R to retry");
-    }
-    else if (screen->game.win && state->num_ticks % 20 < 10) {
-        canvas_foreground(&state->canvas, green);
-        canvas_background(&state->canvas, black);
-
-        canvas_fill(&state->canvas, x_offset + 26, y_offset + 9, 29, 7, ' ');
-        canvas_rect(&state->canvas, x_offset + 27, y_offset + 10, 27, 5, '#');
-        canvas_write(&state->canvas, x_offset + 29, y_offset + 12, "press space to continue");
-    }
+    // Draw the game field in the center of the canvas, coloring individual
+    // cells while the game is in progress
+    struct canvas_palette const *palette = (color && game_state == GAME_STATE_IN_PROGRESS) ? &screen->palette : NULL;
+    canvas_blit_utf32(&state->canvas, x_offset, y_offset, COLUMNS, ROWS,
+                      (uint32_t *) screen->game.field, palette);
 
     // Draw a border around the game
     if (x_offset >= 3 && y_offset >= 4) {
@@ -219,16 +265,18 @@ bool game_screen_update(void *data, struct state *state, struct env *env) {
 
         //canvas_rect(&state->canvas, x_offset - 1, y_offset - 1, COLUMNS + 2, ROWS + 2, ' ');
 
-        canvas_line(&state->canvas, x_offset, y_offset - 1, x_offset + COLUMNS - 1, y_offset - 1, '-');
-        canvas_line(&state->canvas, x_offset, y_offset + ROWS, x_offset + COLUMNS - 1, y_offset + ROWS, '-');
-        canvas_line(&state->canvas, x_offset - 1, y_offset, x_offset - 1, y_offset + ROWS - 1, '|');
-        canvas_line(&state->canvas, x_offset + COLUMNS, y_offset, x_offset + COLUMNS, y_offset + ROWS - 1, '|');
-        for (int horiz = 0; horiz < 2; horiz++) {
-            for (int vert = 0; vert < 2; vert++) {
-                canvas_put(&state->canvas,
-                           x_offset - 1 + horiz * (COLUMNS + 1),
-                           y_offset - 1 + vert * (ROWS + 1),
-                           '+');
+        if (state->redraw) {
+            canvas_line(&state->canvas, x_offset, y_offset - 1, x_offset + COLUMNS - 1, y_offset - 1, '-');
+            canvas_line(&state->canvas, x_offset, y_offset + ROWS, x_offset + COLUMNS - 1, y_offset + ROWS, '-');
+            canvas_line(&state->canvas, x_offset - 1, y_offset, x_offset - 1, y_offset + ROWS - 1, '|');
+            canvas_line(&state->canvas, x_offset + COLUMNS, y_offset, x_offset + COLUMNS, y_offset + ROWS - 1, '|');
+            for (int horiz = 0; horiz < 2; horiz++) {
+                for (int vert = 0; vert < 2; vert++) {
+                    canvas_put(&state->canvas,
+                               x_offset - 1 + horiz * (COLUMNS + 1),
+                               y_offset - 1 + vert * (ROWS + 1),
+                               '+');
+                }
             }
         }
 
@@ -237,13 +285,16 @@ bool game_screen_update(void *data, struct state *state, struct env *env) {
 
         canvas_write(&state->canvas, x_offset, y_offset + ROWS + 1, buf);
 
-        screen->game.input_log[screen->game.input_log_len] = '\0';
-        canvas_write_block(&state->canvas, x_offset, y_offset + ROWS + 2, COLUMNS, 2, screen->game.input_log);
-    }
+        // The log only ever grows, unless the game was restarted
+        if (screen->game.input_log_len != screen->drawn_input_log_len) {
+            if (screen->game.input_log_len < screen->drawn_input_log_len) {
+                canvas_fill(&state->canvas, x_offset, y_offset + ROWS + 2, COLUMNS, 2, ' ');
+            }
+            screen->drawn_input_log_len = screen->game.input_log_len;
 
-    // Resend the entire canvas every so many ticks
-    if (state->num_ticks % 100 == 99) {
-        canvas_force_next_flush(&state->canvas);
+            screen->game.input_log[screen->game.input_log_len] = '\0';
+            canvas_write_block(&state->canvas, x_offset, y_offset + ROWS + 2, COLUMNS, 2, screen->game.input_log);
+        }
     }
 
     return true;
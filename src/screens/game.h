@@ -9,11 +9,27 @@ extern "C" {
 
 struct env;
 struct state;
+struct canvas;
+struct canvas_palette;
+struct game;
+
+// Canvas layer the game over prompt is drawn on
+#define GAME_SCREEN_PROMPT_LAYER 1
 
 struct screen *game_screen_create(struct env *env, uint32_t level_id);
 
+void game_screen_destroy(void *data, struct state *state);
+
 bool game_screen_update(void *data, struct state *state, struct env *env);
 
+// Colors for the glyphs that stand out on the field while a game is going
+void game_screen_palette(struct canvas_palette *palette);
+
+// Draw the box shown once the game is over onto its own layer, so that blinking
+// it doesn't touch the field underneath
+void game_screen_draw_prompt(struct canvas *canvas, struct game *game, unsigned x_offset,
+                             unsigned y_offset);
+
 #ifdef __cplusplus
 }
 #endif
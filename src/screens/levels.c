@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "../util.h"
 #include "../db.h"
@@ -10,12 +11,25 @@
 #include "replay.h"
 
 struct screen_impl level_pit_screen_impl = {
-        .update=level_pit_screen_update
+        .update=level_pit_screen_update,
+        // Stats only change when someone finishes a level, so picking that
+        // up every few seconds is plenty
+        .idle_ticks=50,
 };
 
+#define LEVEL_PIT_ROWS 16
+// Room for a formatted row, of which the table only shows the first 55 columns
+#define LEVEL_PIT_ROW_LEN 80
+#define LEVEL_PIT_TABLE_W 55
+
 struct level_pit_screen_state {
     uint32_t top_id;
     int selected_index;
+
+    // What's currently on the canvas, so only rows that changed are redrawn
+    char drawn_rows[LEVEL_PIT_ROWS][LEVEL_PIT_ROW_LEN];
+    int drawn_selected_index;
+    uint32_t drawn_scrollbar[3];
 };
 
 struct screen *level_pit_screen_create(struct env *env) {
@@ -60,11 +74,8 @@ size_t snprintf_time_in_ticks(char *buf, size_t len, uint32_t num_ticks) {
     return snprintf(buf, len, "%u:%02u.%01u", minutes, seconds, milliseconds / 100);
 }
 
-bool level_pit_screen_update(void *data, struct state *state, struct env *env) {
-    struct level_pit_screen_state *screen = data;
-
-    canvas_foreground(&state->canvas, white);
-    canvas_background(&state->canvas, black);
+// Draw what stays put for as long as the screen is up
+static void draw_static(struct state *state) {
     canvas_erase(&state->canvas);
 
     char *logo =
@@ -80,10 +91,54 @@ bool level_pit_screen_update(void *data, struct state *state, struct env *env) {
             "    # NAME         CREATED    PLAYS   WINRATE BEST TIME"// AVG TIME "
             "===== ============ ========== ======= ======= =========";// =========";
 
-    canvas_write_block(&state->canvas, 12, 6, 55, 2, header);
+    canvas_write_block(&state->canvas, 12, 6, LEVEL_PIT_TABLE_W, 2, header);
+}
+
+static void format_row(char *buf, size_t len, struct metadata *metadata) {
+    // Format the timestamps
+    time_t const creation_timestamp = (time_t) metadata->creation_time;
+    struct tm creation_tm;
+    char creation_time_buf[32];
+    strftime(creation_time_buf, sizeof(creation_time_buf), "%Y-%m-%d", gmtime_r(&creation_timestamp, &creation_tm));
+
+    char best_time_buf[32];
+    if (metadata->num_wins == 0) {
+        memcpy(best_time_buf, "-", 2);
+    } else {
+        snprintf_time_in_ticks(best_time_buf, sizeof(best_time_buf), metadata->min_ticks);
+    }
+
+    double win_rate = 0;
+    if (metadata->num_attempts > 0) {
+        win_rate = ((double)metadata->num_wins / metadata->num_attempts) * 100;
+    }
+
+    snprintf(buf, len, "%5d %-12s %10s %7d  %5.01f%% %9s",
+            metadata->id,
+            metadata->name,
+            creation_time_buf,
+            metadata->num_attempts,
+            win_rate,
+            best_time_buf);
+}
+
+bool level_pit_screen_update(void *data, struct state *state, struct env *env) {
+    struct level_pit_screen_state *screen = data;
 
-    struct metadata metadata[16];
-    int const num_levels = db_get_metadata(env->db, screen->top_id - 1, metadata, 16);
+    canvas_foreground(&state->canvas, white);
+    canvas_background(&state->canvas, black);
+
+    if (state->redraw) {
+        draw_static(state);
+
+        // Forget the list, since it was just erased
+        memset(screen->drawn_rows, 0, sizeof(screen->drawn_rows));
+        memset(screen->drawn_scrollbar, 0xff, sizeof(screen->drawn_scrollbar));
+        screen->drawn_selected_index = -1;
+    }
+
+    struct metadata metadata[LEVEL_PIT_ROWS];
+    int num_levels = db_get_metadata(env->db, screen->top_id - 1, metadata, LEVEL_PIT_ROWS);
 
     uint32_t min_id = 0;
     uint32_t max_id = 0;
@@ -92,38 +147,63 @@ bool level_pit_screen_update(void *data, struct state *state, struct env *env) {
         return false;
     }
 
-    // Draw level list
-    uint32_t selected_id = 0;
-    for (int i = 0; i < num_levels; i++) {
-        // Format the timestamps
-        time_t const creation_timestamp = (time_t) metadata[i].creation_time;
-        char creation_time_buf[32];
-        strftime(creation_time_buf, sizeof(creation_time_buf), "%Y-%m-%d", gmtime(&creation_timestamp));
-
-        char best_time_buf[32];
-        if (metadata[i].num_wins == 0) {
-            memcpy(best_time_buf, "-", 2);
-        } else {
-            snprintf_time_in_ticks(best_time_buf, sizeof(best_time_buf), metadata[i].min_ticks);
+    // Handle input, in the order it was pressed, before drawing what it did
+    struct input_event event;
+    while (terminal_next_event(&state->terminal, &event)) {
+        uint32_t const selected_id = screen->selected_index < num_levels ? metadata[screen->selected_index].id : 0;
+
+        if (event.key == ' ' || event.key == '\r') {
+            state_push_screen(state, game_screen_create(env, selected_id));
+            return true;
+        } else if (event.key == INPUT_KEY_UP) {
+            if (screen->selected_index > 0) {
+                screen->selected_index--;
+            } else if (screen->top_id > min_id) {
+                screen->top_id = db_get_previous_level(env->db, screen->top_id);
+                num_levels = db_get_metadata(env->db, screen->top_id - 1, metadata, LEVEL_PIT_ROWS);
+            }
+        } else if (event.key == INPUT_KEY_DOWN) {
+            if (screen->selected_index < num_levels - 1) {
+                screen->selected_index++;
+            } else if (num_levels == LEVEL_PIT_ROWS && metadata[num_levels - 1].id < max_id) {
+                screen->top_id = metadata[1].id;
+                num_levels = db_get_metadata(env->db, screen->top_id - 1, metadata, LEVEL_PIT_ROWS);
+            }
+        } else if (event.key == 'q' || event.key == 'Q') {
+            return false;
+        } else if (event.key == 'r' || event.key == 'R') {
+            if (metadata[screen->selected_index].num_wins == 0) {
+                LOG_ERROR("No wins");
+            } else {
+                uint32_t attempt_id = 0;
+                if (!db_get_best_attempt(env->db, selected_id, &attempt_id)) {
+                    LOG_ERROR("Couldn't find best attempt for level %d", selected_id);
+                } else {
+                    state_push_screen(state, replay_screen_create(env, attempt_id));
+                    return true;
+                }
+            }
         }
+    }
 
-        double win_rate = 0;
-        if (metadata[i].num_attempts > 0) {
-            win_rate = ((double)metadata[i].num_wins / metadata[i].num_attempts) * 100;
-        }
+    KEYBOARD_CLEAR(state->terminal.keyboard);
 
-        char buf[80];
-        snprintf(buf, 80, "%5d %-12s %10s %7d  %5.01f%% %9s",
-                metadata[i].id,
-                metadata[i].name,
-                creation_time_buf,
-                metadata[i].num_attempts,
-                win_rate,
-                best_time_buf);
+    // Draw level list
+    for (int i = 0; i < LEVEL_PIT_ROWS; i++) {
+        char buf[LEVEL_PIT_ROW_LEN] = {0};
+        if (i < num_levels) {
+            format_row(buf, sizeof(buf), &metadata[i]);
+        }
 
-        if (i == screen->selected_index) {
-            selected_id = metadata[i].id;
+        // Nothing to do if neither the row nor whether it's highlighted changed
+        bool const was_selected = (i == screen->drawn_selected_index && screen->drawn_rows[i][0] != '\0');
+        bool const is_selected = (i == screen->selected_index && i < num_levels);
+        if (!strcmp(buf, screen->drawn_rows[i]) && was_selected == is_selected) {
+            continue;
+        }
+        memcpy(screen->drawn_rows[i], buf, sizeof(buf));
 
+        if (is_selected) {
             canvas_foreground(&state->canvas, black);
             canvas_background(&state->canvas, white);
         }
@@ -132,49 +212,25 @@ bool level_pit_screen_update(void *data, struct state *state, struct env *env) {
             canvas_background(&state->canvas, black);
         }
 
+        // Clear out whatever was there before, in case the new row is shorter
+        canvas_fill(&state->canvas, 12, 8 + i, LEVEL_PIT_TABLE_W, 1, ' ');
         canvas_write(&state->canvas, 12, 8 + i, buf);
     }
+    screen->drawn_selected_index = screen->selected_index;
 
     canvas_foreground(&state->canvas, white);
     canvas_background(&state->canvas, black);
 
     // Draw scrollbar
-    draw_scrollbar(&state->canvas, 72, 8, 3, 16,
-                   (num_levels > 0 ? metadata[0].id : 0),
-                   (num_levels > 0 ? metadata[num_levels-1].id : 0),
-                   max_id);
-
-    // Handle input
-    if (state->terminal.keyboard.space || state->terminal.keyboard.enter) {
-        state_push_screen(state, game_screen_create(env, selected_id));
-    } else if (state->terminal.keyboard.up) {
-        if (screen->selected_index > 0) {
-            screen->selected_index--;
-        } else if (screen->top_id > min_id) {
-            screen->top_id = db_get_previous_level(env->db, screen->top_id);
-        }
-    } else if (state->terminal.keyboard.down) {
-        if (screen->selected_index < num_levels - 1) {
-            screen->selected_index++;
-        } else if (num_levels == 16 && metadata[num_levels - 1].id < max_id) {
-            screen->top_id = metadata[1].id;
-        }
-    } else if (KEYBOARD_KEY_PRESSED(state->terminal.keyboard, 'Q')) {
-        return false;
-    } else if (KEYBOARD_KEY_PRESSED(state->terminal.keyboard, 'R')) {
-        if (metadata[screen->selected_index].num_wins == 0) {
-            LOG_ERROR("No wins");
-        } else {
-            uint32_t attempt_id = 0;
-            if (!db_get_best_attempt(env->db, selected_id, &attempt_id)) {
-                LOG_ERROR("Couldn't find best attempt for level %d", selected_id);
-            } else {
-                state_push_screen(state, replay_screen_create(env, attempt_id));
-            }
-        }
+    uint32_t const scrollbar[3] = {
+            (num_levels > 0 ? metadata[0].id : 0),
+            (num_levels > 0 ? metadata[num_levels-1].id : 0),
+            max_id,
+    };
+    if (memcmp(scrollbar, screen->drawn_scrollbar, sizeof(scrollbar)) != 0) {
+        memcpy(screen->drawn_scrollbar, scrollbar, sizeof(scrollbar));
+        draw_scrollbar(&state->canvas, 72, 8, 3, 16, scrollbar[0], scrollbar[1], scrollbar[2]);
     }
 
-    KEYBOARD_CLEAR(state->terminal.keyboard);
-
     return true;
 }
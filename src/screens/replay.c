@@ -4,6 +4,7 @@
 #include "../db.h"
 #include "../screen.h"
 #include "replay.h"
+#include "game.h"
 #include "log.h"
 
 struct screen_impl replay_screen_impl = {
@@ -15,9 +16,15 @@ struct replay_screen_state {
     struct attempt attempt;
 
     struct game game;
+    struct canvas_palette palette;
 
     char *next_input;
     uint32_t remaining_idles;
+
+    // What's currently on the canvas, so ticks where nothing moved draw nothing
+    uint32_t drawn_tick;
+    bool drawn_prompt;
+    size_t drawn_input_log_len;
 };
 
 struct screen *replay_screen_create(struct env *env, uint32_t attempt_id) {
@@ -28,6 +35,7 @@ struct screen *replay_screen_create(struct env *env, uint32_t attempt_id) {
             .attempt_id = attempt_id,
     };
     screen_base->impl = &replay_screen_impl;
+    game_screen_palette(&screen->palette);
 
     if (!db_get_attempt(env->db, attempt_id, &screen->attempt)) {
         LOG_ERROR("Failed to find attempt %d", attempt_id);
@@ -61,7 +69,10 @@ bool replay_screen_update(void *data, struct state *state, struct env *env) {
     struct replay_screen_state *screen = data;
 
     canvas_reset(&state->canvas);
-    canvas_erase(&state->canvas);
+    if (state->redraw) {
+        canvas_erase(&state->canvas);
+        screen->drawn_input_log_len = 0;
+    }
 
     // Handle inputs
     if (KEYBOARD_KEY_PRESSED(state->terminal.keyboard, 'Q')) {
@@ -113,66 +124,34 @@ bool replay_screen_update(void *data, struct state *state, struct env *env) {
 
     enum game_state game_state = game_update(&screen->game, &input);
 
-    canvas_foreground(&state->canvas, default_color);
-    canvas_background(&state->canvas, default_color);
-
-    // Draw the game field in the center of the canvas
     unsigned int const x_offset = (state->canvas.w - 80) / 2;
     unsigned int const y_offset = (state->canvas.h - 25) / 2;
-    canvas_write_block_utf32(&state->canvas, x_offset, y_offset, 80, 25,
-                             (uint32_t *) screen->game.field, ROWS * COLUMNS);
-
-    // Color individual cells
-    if (game_state == GAME_STATE_IN_PROGRESS) {
-        for (unsigned y = 0; y < 25; y++) {
-            for (unsigned x = 0; x < 80; x++) {
-                unsigned long ch = screen->game.field[y][x];
-                switch (ch) {
-                    case 'I':
-                        canvas_foreground(&state->canvas, white);
-                        canvas_background(&state->canvas, blue);
-                        break;
-
-                    case 0xa3:
-                    case 'E':
-                        canvas_foreground(&state->canvas, white);
-                        canvas_background(&state->canvas, green);
-                        break;
-
-                    case '[':
-                    case ']':
-                    case '{':
-                    case '}':
-                    case 'X':
-                    case '%':
-                        canvas_foreground(&state->canvas, white);
-                        canvas_background(&state->canvas, red);
-                        break;
-
-                    default: continue;
-                }
-                canvas_put(&state->canvas, x_offset + x, y_offset + y, ch);
-            }
-        }
-    }
 
-    // Draw instructions
-    if (screen->game.die && state->num_ticks % 20 < 10) {
-        canvas_foreground(&state->canvas, red);
-        canvas_background(&state->canvas, black);
-
-        canvas_fill(&state->canvas, x_offset + 29, y_offset + 9, 22, 7, ' ');
-        canvas_rect(&state->canvas, x_offset + 30, y_offset + 10, 20, 5, '#');
-        canvas_write(&state->canvas, x_offset + 32, y_offset + 12, "press R to retry");
+    // Blink the prompt once the game is over
+    bool const game_over = screen->game.win || screen->game.die;
+    if (game_over != screen->drawn_prompt || (game_over && state->redraw)) {
+        game_screen_draw_prompt(&state->canvas, &screen->game, x_offset, y_offset);
+        screen->drawn_prompt = game_over;
     }
-    else if (screen->game.win && state->num_ticks % 20 < 10) {
-        canvas_foreground(&state->canvas, green);
-        canvas_background(&state->canvas, black);
+    canvas_show_layer(&state->canvas, GAME_SCREEN_PROMPT_LAYER,
+                      game_over && state->num_ticks % 20 < 10);
 
-        canvas_fill(&state->canvas, x_offset + 26, y_offset + 9, 29, 7, ' ');
-        canvas_rect(&state->canvas, x_offset + 27, y_offset + 10, 27, 5, '#');
-        canvas_write(&state->canvas, x_offset + 29, y_offset + 12, "press space to continue");
+    // The field stops changing once the game is over, so there's nothing left
+    // to draw until it starts over
+    if (!state->redraw && screen->game.tick == screen->drawn_tick) {
+        return true;
     }
+    screen->drawn_tick = screen->game.tick;
+
+    canvas_foreground(&state->canvas, default_color);
+    canvas_background(&state->canvas, default_color);
+
+    // Draw the game field in the center of the canvas, coloring individual
+    // cells while the game is in progress
+    struct canvas_palette const *palette =
+            (game_state == GAME_STATE_IN_PROGRESS) ? &screen->palette : NULL;
+    canvas_blit_utf32(&state->canvas, x_offset, y_offset, 80, 25,
+                      (uint32_t *) screen->game.field, palette);
 
     if (x_offset > 2 && y_offset > 3) {
         canvas_foreground(&state->canvas, default_color);
@@ -180,16 +159,18 @@ bool replay_screen_update(void *data, struct state *state, struct env *env) {
 
         //canvas_rect(&state->canvas, x_offset - 1, y_offset - 1, COLUMNS + 2, ROWS + 2, ' ');
 
-        canvas_line(&state->canvas, x_offset, y_offset - 1, x_offset + COLUMNS - 1, y_offset - 1, '-');
-        canvas_line(&state->canvas, x_offset, y_offset + ROWS, x_offset + COLUMNS - 1, y_offset + ROWS, '-');
-        canvas_line(&state->canvas, x_offset - 1, y_offset, x_offset - 1, y_offset + ROWS - 1, '|');
-        canvas_line(&state->canvas, x_offset + COLUMNS, y_offset, x_offset + COLUMNS, y_offset + ROWS - 1, '|');
-        for (int horiz = 0; horiz < 2; horiz++) {
-            for (int vert = 0; vert < 2; vert++) {
-                canvas_put(&state->canvas,
-                           x_offset - 1 + horiz * (COLUMNS + 1),
-                           y_offset - 1 + vert * (ROWS + 1),
-                           '+');
+        if (state->redraw) {
+            canvas_line(&state->canvas, x_offset, y_offset - 1, x_offset + COLUMNS - 1, y_offset - 1, '-');
+            canvas_line(&state->canvas, x_offset, y_offset + ROWS, x_offset + COLUMNS - 1, y_offset + ROWS, '-');
+            canvas_line(&state->canvas, x_offset - 1, y_offset, x_offset - 1, y_offset + ROWS - 1, '|');
+            canvas_line(&state->canvas, x_offset + COLUMNS, y_offset, x_offset + COLUMNS, y_offset + ROWS - 1, '|');
+            for (int horiz = 0; horiz < 2; horiz++) {
+                for (int vert = 0; vert < 2; vert++) {
+                    canvas_put(&state->canvas,
+                               x_offset - 1 + horiz * (COLUMNS + 1),
+                               y_offset - 1 + vert * (ROWS + 1),
+                               '+');
+                }
             }
         }
 
@@ -198,13 +179,13 @@ bool replay_screen_update(void *data, struct state *state, struct env *env) {
 
         canvas_write(&state->canvas, x_offset, y_offset + ROWS + 1, buf);
 
-        screen->game.input_log[screen->game.input_log_len] = '\0';
-        canvas_write_block(&state->canvas, x_offset, y_offset + ROWS + 2, COLUMNS, 3, screen->game.input_log);
-    }
+        // The log only ever grows
+        if (screen->game.input_log_len != screen->drawn_input_log_len) {
+            screen->drawn_input_log_len = screen->game.input_log_len;
 
-    // Resend the entire canvas every so many ticks
-    if (state->num_ticks % 100 == 99) {
-        canvas_force_next_flush(&state->canvas);
+            screen->game.input_log[screen->game.input_log_len] = '\0';
+            canvas_write_block(&state->canvas, x_offset, y_offset + ROWS + 2, COLUMNS, 3, screen->game.input_log);
+        }
     }
 
     return true;
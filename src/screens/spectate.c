@@ -0,0 +1,185 @@
+#include <baro.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../state.h"
+#include "../screen.h"
+#include "../stream.h"
+#include "../util.h"
+#include "spectate.h"
+
+struct screen_impl spectate_screen_impl = {
+        .destroy = spectate_screen_destroy,
+        .update = spectate_screen_update
+};
+
+struct spectate_screen_state {
+    // The game being watched, or NULL if nobody is playing
+    struct stream *stream;
+    uint64_t next_frame;
+
+    // Whether the client is showing the stream (or the message saying there's
+    // none), so that the frames after it can be sent as is
+    bool synced;
+
+    // Tick to look for a game on next while there's nothing to watch
+    size_t next_poll;
+};
+
+struct screen *spectate_screen_create(void) {
+    struct screen *screen = malloc(sizeof(struct screen) + sizeof(struct spectate_screen_state));
+    *(struct spectate_screen_state *)screen->data = (struct spectate_screen_state){
+            .stream = stream_find(0, false),
+            .synced = false,
+            .next_poll = 0,
+    };
+    screen->impl = &spectate_screen_impl;
+    return screen;
+}
+
+void spectate_screen_destroy(void *data, struct state *state) {
+    struct spectate_screen_state *screen = data;
+
+    if (screen->stream != NULL) {
+        stream_release(screen->stream);
+    }
+
+    // The canvas has no idea what the stream left on the client's screen
+    terminal_resync(&state->terminal);
+}
+
+// Switch to the next game after (or before) the current one
+static void switch_stream(struct spectate_screen_state *screen, bool backwards) {
+    uint64_t const id = screen->stream != NULL ? screen->stream->id : 0;
+    if (screen->stream != NULL) {
+        stream_release(screen->stream);
+    }
+
+    screen->stream = stream_find(id, backwards);
+    screen->synced = false;
+}
+
+bool spectate_screen_update(void *data, struct state *state, struct env *env) {
+    struct spectate_screen_state *screen = data;
+    (void) env;
+
+    // Handle inputs
+    struct keyboard_input const keyboard = state->terminal.keyboard;
+    KEYBOARD_CLEAR(state->terminal.keyboard);
+
+    if (KEYBOARD_KEY_PRESSED(keyboard, 'Q') || keyboard.esc) {
+        return false;
+    }
+    else if (keyboard.left || keyboard.right) {
+        switch_stream(screen, keyboard.left);
+    }
+
+    // Move on once the player leaves, and look for a game every second while
+    // there's nothing to watch. Ticks can be skipped, so this goes by deadline
+    if (screen->stream != NULL && !stream_is_live(screen->stream)) {
+        switch_stream(screen, false);
+    }
+    else if (screen->stream == NULL && state->num_ticks >= screen->next_poll) {
+        screen->next_poll = state->num_ticks + 10;
+        screen->stream = stream_find(0, false);
+        if (screen->stream != NULL) {
+            screen->synced = false;
+        }
+    }
+
+    // The client's screen was resized or cleared, so it has to be rebuilt.
+    // The canvas staying dirty only means the client hasn't caught up yet
+    if (state->redraw || state->terminal.resynced) {
+        screen->synced = false;
+    }
+
+    if (screen->synced) {
+        if (screen->stream == NULL ||
+            stream_read(screen->stream, &state->canvas, &state->terminal.shared,
+                        &screen->next_frame)) {
+            return true;
+        }
+
+        // Fell too far behind, but a keyframe covers up everything that was
+        // missed without having to clear the screen first
+        stream_keyframe(screen->stream, &state->canvas, &state->terminal.shared,
+                        &screen->next_frame);
+        return true;
+    }
+
+    // Start over from an empty screen, since frames only draw over what's
+    // already on it
+    buffer_queue_destroy(&state->terminal.shared);
+    canvas_reset(&state->canvas);
+    canvas_erase(&state->canvas);
+    terminal_resync(&state->terminal);
+    state->terminal.resynced = false;
+    screen->synced = true;
+
+    if (screen->stream != NULL) {
+        stream_keyframe(screen->stream, &state->canvas, &state->terminal.shared,
+                        &screen->next_frame);
+        return true;
+    }
+
+    unsigned int const x_offset = (state->canvas.w - 80) / 2;
+    unsigned int const y_offset = (state->canvas.h - 25) / 2;
+    canvas_write(&state->canvas, x_offset + 27, y_offset + 11, "nobody is playing right now");
+    canvas_write(&state->canvas, x_offset + 29, y_offset + 13, "press Q to go back");
+
+    return true;
+}
+
+TEST("[spectate] spectate_screen_update") {
+    struct state state = {0};
+    canvas_create(&state.canvas, 80, 25);
+    terminal_create(&state.terminal, &state.canvas);
+
+    struct canvas player;
+    canvas_create(&player, 80, 25);
+    canvas_write(&player, 10, 10, "player");
+    struct stream *stream = stream_open(80, 25);
+    stream_publish(stream, &player);
+
+    struct screen *screen = spectate_screen_create();
+    state.redraw = true;
+
+    SUBTEST("a spectator that hasn't caught up isn't cleared again") {
+        REQUIRE(spectate_screen_update(screen->data, &state, NULL));
+        size_t const len = state.terminal.shared.len;
+        REQUIRE(len > 0);
+
+        // Nothing was encoded or sent in between, so the canvas is still dirty
+        state.redraw = false;
+        state.num_ticks++;
+        canvas_put(&player, 10, 10, 'P');
+        stream_publish(stream, &player);
+        REQUIRE(spectate_screen_update(screen->data, &state, NULL));
+        REQUIRE(canvas_is_dirty(&state.canvas));
+
+        size_t num_clears = 0;
+        char const *p = state.terminal.buffer;
+        char const *end = &state.terminal.buffer[state.terminal.buffer_len];
+        while ((p = kmp_strnstr(p, "\x1b[2J", end - p)) != NULL) {
+            num_clears++;
+            p++;
+        }
+        REQUIRE_EQ(num_clears, 1);
+        REQUIRE_EQ(state.terminal.shared.len, len);
+    }
+
+    SUBTEST("asking for a resync rebuilds the screen") {
+        buffer_queue_consume(&state.terminal.shared, state.terminal.shared.len);
+        state.terminal.buffer_len = 0;
+
+        terminal_resync(&state.terminal);
+        REQUIRE(spectate_screen_update(screen->data, &state, NULL));
+        REQUIRE_FALSE(state.terminal.resynced);
+        REQUIRE(state.terminal.shared.len > 0);
+    }
+
+    screen_destroy(screen, &state);
+    stream_close(stream);
+    canvas_destroy(&player);
+    terminal_destroy(&state.terminal);
+    canvas_destroy(&state.canvas);
+}
@@ -0,0 +1,23 @@
+#ifndef SSB_SCREEN_SPECTATE_H
+#define SSB_SCREEN_SPECTATE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+struct env;
+struct state;
+
+struct screen *spectate_screen_create(void);
+
+void spectate_screen_destroy(void *data, struct state *state);
+
+bool spectate_screen_update(void *data, struct state *state, struct env *env);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SSB_SCREEN_SPECTATE_H
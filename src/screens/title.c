@@ -8,14 +8,23 @@
 #include "title.h"
 #include "game.h"
 #include "levels.h"
+#include "spectate.h"
 #include "log.h"
 
 struct screen_impl title_screen_impl = {
         .update=title_screen_update,
+        // Wake up to pan the logo around
+        .idle_ticks=8,
 };
 
 struct title_screen_state {
     int selection;
+
+    // What's currently on the canvas, so unchanged ticks draw nothing
+    int drawn_selection;
+    unsigned drawn_logo_frame;
+    int drawn_num_levels;
+    size_t drawn_num_sessions;
 };
 
 struct screen *title_screen_create(struct state *state) {
@@ -24,11 +33,14 @@ struct screen *title_screen_create(struct state *state) {
     terminal_write(&state->terminal, IAC DONT ECHO);
     terminal_write(&state->terminal, IAC WILL SUPPRESS_GO_AHEAD);
     terminal_write(&state->terminal, IAC DO NAWS);
+    terminal_write(&state->terminal, IAC DO TERMINAL_TYPE);
+    terminal_write(&state->terminal, IAC WILL END_OF_RECORD);
+
+    // Ask whether the terminal supports synchronized output (DECRQM)
+    terminal_write(&state->terminal, CSI "?2026$p");
 
     // Empty the terminal and hide the cursor
-    terminal_clear(&state->terminal);
-    terminal_move(&state->terminal, 0, 0);
-    terminal_reset(&state->terminal);
+    terminal_resync(&state->terminal);
     terminal_cursor(&state->terminal, false);
 
     struct screen *screen = malloc(sizeof(struct screen) + sizeof(struct title_screen_state));
@@ -43,41 +55,67 @@ bool title_screen_update(void *data, struct state *state, struct env *env) {
     struct title_screen_state *screen = data;
 
     // Handle input
-    if (state->terminal.keyboard.space || state->terminal.keyboard.enter) {
-        switch (screen->selection) {
-            // classic mode
-            case 0:
-                state_push_screen(state, game_screen_create(env, 166));
-                return true;
-
-            // level pit
-            case 1:
-                state_push_screen(state, level_pit_screen_create(env));
-                return true;
-
-            // instructions
-            case 2:
-                //TODO
-                break;
-
-            // quit game
-            case 3:
-                // Clean up the terminal before we kill the connection
-                terminal_reset(&state->terminal);
-                terminal_cursor(&state->terminal, true);
-
-                return false;
+    struct input_event event;
+    while (terminal_next_event(&state->terminal, &event)) {
+        if (event.key == ' ' || event.key == '\r') {
+            switch (screen->selection) {
+                // classic mode
+                case 0:
+                    state_push_screen(state, game_screen_create(env, 166));
+                    return true;
+
+                // level pit
+                case 1:
+                    state_push_screen(state, level_pit_screen_create(env));
+                    return true;
+
+                // watch a game
+                case 2:
+                    state_push_screen(state, spectate_screen_create());
+                    return true;
+
+                // instructions
+                case 3:
+                    //TODO
+                    break;
+
+                // quit game
+                case 4:
+                    // Clean up the terminal before we kill the connection
+                    terminal_reset(&state->terminal);
+                    terminal_cursor(&state->terminal, true);
+
+                    return false;
+            }
+        }
+        else if (event.key == INPUT_KEY_UP && screen->selection > 0) {
+            screen->selection--;
+        }
+        else if (event.key == INPUT_KEY_DOWN && screen->selection < 4) {
+            screen->selection++;
         }
-    }
-    else if (state->terminal.keyboard.up && screen->selection > 0) {
-        screen->selection--;
-    }
-    else if (state->terminal.keyboard.down && screen->selection < 3) {
-        screen->selection++;
     }
 
     KEYBOARD_CLEAR(state->terminal.keyboard);
 
+    // The logo pans around every eight ticks, and the counts change whenever
+    // someone else connects or adds a level, so anything else is a no-op
+    unsigned const logo_frame = (state->num_ticks % 32) / 8;
+    int const num_levels = db_num_levels(env->db);
+    size_t const num_sessions = env->server ? server_num_online_sessions() : 0;
+    if (!state->redraw &&
+        screen->selection == screen->drawn_selection &&
+        logo_frame == screen->drawn_logo_frame &&
+        num_levels == screen->drawn_num_levels &&
+        num_sessions == screen->drawn_num_sessions) {
+        return true;
+    }
+
+    screen->drawn_selection = screen->selection;
+    screen->drawn_logo_frame = logo_frame;
+    screen->drawn_num_levels = num_levels;
+    screen->drawn_num_sessions = num_sessions;
+
     canvas_reset(&state->canvas);
     canvas_erase(&state->canvas);
 
@@ -101,20 +139,19 @@ bool title_screen_update(void *data, struct state *state, struct env *env) {
             "                           \\/_____/  \\/_/ /_/  \\/_____/  \\/_____/";
 
     // Pan the logo around
-    unsigned tick = (state->num_ticks % 32) / 8;
-    int dx = tick == 1 || tick == 2 ? 1 : 0;
-    int dy = tick == 2 || tick == 3 ? 1 : 0;
+    int dx = logo_frame == 1 || logo_frame == 2 ? 1 : 0;
+    int dy = logo_frame == 2 || logo_frame == 3 ? 1 : 0;
     canvas_write_block(&state->canvas, x_offset + 7 + dx, y_offset + 1 + dy, 65, 13, logo);
 
     char buf[32];
-    snprintf(buf, 32, "%d levels", db_num_levels(env->db));
+    snprintf(buf, 32, "%d levels", num_levels);
     canvas_write(&state->canvas, x_offset + 4, y_offset + 12, buf);
     if (env->server) {
-        if (env->server->num_sessions == 1) {
+        if (num_sessions == 1) {
             canvas_write(&state->canvas, x_offset + 4, y_offset + 13, "1 player online");
         }
         else {
-            snprintf(buf, 32, "%ld players online", env->server->num_sessions);
+            snprintf(buf, 32, "%ld players online", num_sessions);
             canvas_write(&state->canvas, x_offset + 4, y_offset + 13, buf);
         }
     }
@@ -123,12 +160,13 @@ bool title_screen_update(void *data, struct state *state, struct env *env) {
     }
     canvas_write(&state->canvas, x_offset + 4, y_offset + 14, "last updated 2023-09-30");
 
-    canvas_write(&state->canvas, x_offset + 33, y_offset + 17, "classic mode");
-    canvas_write(&state->canvas, x_offset + 33, y_offset + 19, "level pit");
-    canvas_write(&state->canvas, x_offset + 33, y_offset + 21, "instructions");
-    canvas_write(&state->canvas, x_offset + 33, y_offset + 23, "quit game");
+    canvas_write(&state->canvas, x_offset + 33, y_offset + 16, "classic mode");
+    canvas_write(&state->canvas, x_offset + 33, y_offset + 18, "level pit");
+    canvas_write(&state->canvas, x_offset + 33, y_offset + 20, "watch a game");
+    canvas_write(&state->canvas, x_offset + 33, y_offset + 22, "instructions");
+    canvas_write(&state->canvas, x_offset + 33, y_offset + 24, "quit game");
 
-    canvas_put(&state->canvas, x_offset + 30, y_offset + 17 + 2 * screen->selection, '>');
+    canvas_put(&state->canvas, x_offset + 30, y_offset + 16 + 2 * screen->selection, '>');
 
     return true;
 }
@@ -1,13 +1,31 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include "server.h"
 #include "log.h"
 
+// Shared between the servers of every worker thread
+static _Atomic size_t num_online_sessions = 0;
+
+// Hold on to a descriptor, unless we already are. Returns false if there isn't
+// one to be had
+static bool open_spare_fd(struct server *server) {
+    if (server->spare_fd == -1) {
+        server->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    return server->spare_fd != -1;
+}
+
 bool server_create(struct server *server, char *service) {
     struct addrinfo *addr = NULL;
     struct addrinfo hints = {0};
@@ -49,11 +67,39 @@ bool server_create(struct server *server, char *service) {
         goto failure;
     }
 
+    // Accepts are drained until they would block, so the listener must never
+    // block on its own
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    server->poll_fd = -1;
+#ifdef __linux__
+    server->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->poll_fd == -1) {
+        LOG_ERROR("epoll_create1 failed (%d: %s)", errno, strerror(errno));
+        goto failure;
+    }
+
+    // The listener is the only registration without a session attached
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(server->poll_fd, EPOLL_CTL_ADD, sock, &event) == -1) {
+        LOG_ERROR("epoll_ctl failed (%d: %s)", errno, strerror(errno));
+        close(server->poll_fd);
+        goto failure;
+    }
+#endif
+
     server->socket = sock;
+    server->spare_fd = -1;
+    open_spare_fd(server);
 
     server->sessions = NULL;
     server->num_sessions = 0;
 
+    timer_wheel_create(&server->timers, timer_now());
+    frame_cache_create(&server->frames);
+
+    server->num_events = server->next_event = 0;
+
     return true;
 
     failure:
@@ -77,57 +123,268 @@ void server_destroy(struct server *server) {
 
     // Close the socket
     close(server->socket);
+
+    if (server->poll_fd != -1) {
+        close(server->poll_fd);
+    }
+    if (server->spare_fd != -1) {
+        close(server->spare_fd);
+    }
+
+    LOG_DEBUG("Shared %zu of %zu encoded frames", server->frames.num_hits,
+              server->frames.num_hits + server->frames.num_misses);
+    frame_cache_destroy(&server->frames);
 }
 
-bool server_update(struct server *server) {
-    // Check if data can be read from the socket we're listening to
-    fd_set read_set;
-    FD_ZERO(&read_set);
-    FD_SET(server->socket, &read_set);
+static bool accept_sessions(struct server *server) {
+    // Drain the backlog, since we won't be woken again for connections that
+    // were already pending
+    for (;;) {
+        int sock = accept(server->socket, NULL, NULL);
+        if (sock == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            // Out of descriptors. The connection stays pending and the listener
+            // stays readable, so free up the spare to take it off the backlog
+            // and hang up on it, rather than spinning until one frees up. This
+            // fails even with an empty backlog, so stop once it's drained
+            else if ((errno == EMFILE || errno == ENFILE) && open_spare_fd(server)) {
+                close(server->spare_fd);
+                server->spare_fd = -1;
+                sock = accept(server->socket, NULL, NULL);
+                if (sock != -1) {
+                    LOG_WARN("Out of descriptors, turning a connection away");
+                    close(sock);
+                }
+                open_spare_fd(server);
 
-    // Block for long enough to avoid spinning the CPU, and short enough to
-    // avoid impacting the game loop
-    struct timeval timeout = {.tv_sec=0, .tv_usec=1000};
+                if (sock == -1) {
+                    return true;
+                }
+                continue;
+            }
+            // The connection was reset before we got to it, or we're out of
+            // memory. Neither should take the rest of the server down
+            else if (errno == ECONNABORTED || errno == EINTR || errno == EMFILE ||
+                    errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                LOG_WARN("accept failed (%d: %s)", errno, strerror(errno));
+                return true;
+            }
 
-    int result = select(FD_SETSIZE, &read_set, NULL, NULL, &timeout);
+            LOG_ERROR("accept failed (%d: %s)", errno, strerror(errno));
+            return false;
+        }
+
+        // Create a new session
+        struct session *session = malloc(sizeof(*session));
+        if (!session_create(session, sock)) {
+            LOG_ERROR("session_create failed");
+            return false;
+        }
+
+#ifdef __linux__
+        struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = session};
+        if (epoll_ctl(server->poll_fd, EPOLL_CTL_ADD, sock, &event) == -1) {
+            LOG_ERROR("epoll_ctl failed (%d: %s)", errno, strerror(errno));
+            session_destroy(session);
+            free(session);
+            continue;
+        }
+#endif
+
+        // Add the session to the list
+        session->prev = session->next = NULL;
+        if (server->sessions == NULL) {
+            server->sessions = session;
+        } else {
+            session->next = server->sessions;
+            server->sessions->prev = session;
+            server->sessions = session;
+        }
+        server->num_sessions++;
+        atomic_fetch_add(&num_online_sessions, 1);
+
+        // Run the first tick right away
+        server_schedule_session(server, session);
+    }
+}
+
+#ifdef __linux__
+static int wait_for_events(struct server *server, int timeout_ms, bool *listener_ready) {
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    int result = epoll_wait(server->poll_fd, events, SERVER_MAX_EVENTS, timeout_ms);
     if (result == -1) {
-        LOG_ERROR("select failed (%d: %s)", errno, strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < result; i++) {
+        struct session *session = events[i].data.ptr;
+        if (session == NULL) {
+            *listener_ready = true;
+            continue;
+        }
+
+        unsigned flags = 0;
+        if (events[i].events & EPOLLIN) flags |= SERVER_EVENT_READABLE;
+        if (events[i].events & EPOLLOUT) flags |= SERVER_EVENT_WRITABLE;
+        if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) flags |= SERVER_EVENT_CLOSED;
+
+        server->events[server->num_events++] = (struct server_event){
+                .session = session,
+                .flags = flags,
+        };
+    }
+
+    return result;
+}
+#else
+// Portable fallback for platforms without epoll. The descriptor set is rebuilt
+// on every call, so this is O(sessions) per wakeup
+static int wait_for_events(struct server *server, int timeout_ms, bool *listener_ready) {
+    size_t const num_fds = server->num_sessions + 1;
+    struct pollfd *fds = malloc(num_fds * sizeof(*fds));
+    struct session **sessions = malloc(num_fds * sizeof(*sessions));
+
+    fds[0] = (struct pollfd){.fd = server->socket, .events = POLLIN};
+    sessions[0] = NULL;
+
+    struct session *session = NULL;
+    for (size_t i = 1; server_next_session(server, &session); i++) {
+        short events = POLLIN;
+        if (session->polling_writable) {
+            events |= POLLOUT;
+        }
+        fds[i] = (struct pollfd){.fd = session->socket, .events = events};
+        sessions[i] = session;
+    }
+
+    int result = poll(fds, num_fds, timeout_ms);
+    for (size_t i = 0; result > 0 && i < num_fds; i++) {
+        if (fds[i].revents == 0) {
+            continue;
+        }
+        if (sessions[i] == NULL) {
+            *listener_ready = true;
+            continue;
+        }
+        // Anything left over is still ready on the next call
+        if (server->num_events == SERVER_MAX_EVENTS) {
+            break;
+        }
+
+        unsigned flags = 0;
+        if (fds[i].revents & POLLIN) flags |= SERVER_EVENT_READABLE;
+        if (fds[i].revents & POLLOUT) flags |= SERVER_EVENT_WRITABLE;
+        if (fds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) flags |= SERVER_EVENT_CLOSED;
+
+        server->events[server->num_events++] = (struct server_event){
+                .session = sessions[i],
+                .flags = flags,
+        };
+    }
+
+    free(sessions);
+    free(fds);
+    return result;
+}
+#endif
+
+bool server_update(struct server *server) {
+    server->num_events = server->next_event = 0;
+
+    // Block until something happens on any socket, or until the next tick
+    bool listener_ready = false;
+    int timeout_ms = timer_wheel_timeout_ms(&server->timers, timer_now());
+    if (timeout_ms < 0 || timeout_ms > SERVER_MAX_WAIT_MS) {
+        timeout_ms = SERVER_MAX_WAIT_MS;
+    }
+    int result = wait_for_events(server, timeout_ms, &listener_ready);
+    if (result == -1) {
+        // Interrupted by a signal, so let the caller decide whether to stop
+        if (errno == EINTR) {
+            return true;
+        }
+
+        LOG_ERROR("wait failed (%d: %s)", errno, strerror(errno));
         return false;
     }
-    // There aren't any new connections
-    else if (result == 0) {
+
+    if (listener_ready) {
+        return accept_sessions(server);
+    }
+
+    return true;
+}
+
+bool server_next_event(struct server *server, struct session **session, unsigned *flags) {
+    while (server->next_event < server->num_events) {
+        struct server_event *event = &server->events[server->next_event++];
+        // Skip events for sessions that were disconnected in the meantime
+        if (event->session == NULL) {
+            continue;
+        }
+
+        *session = event->session;
+        *flags = event->flags;
         return true;
     }
 
-    // Accept the new connection
-    int sock = accept(server->socket, NULL, NULL);
-    if (sock == -1) {
-        LOG_ERROR("accept failed (%d: %s)", errno, strerror(errno));
+    return false;
+}
+
+bool server_next_due_session(struct server *server, uint64_t now, struct session **session) {
+    struct timer *timer = timer_wheel_expire(&server->timers, now);
+    if (timer == NULL) {
         return false;
     }
 
-    // Create a new session
-    struct session *session = malloc(sizeof(*session));
-    if (!session_create(session, sock)) {
-        LOG_ERROR("session_create failed");
+    *session = timer->data;
+    return true;
+}
+
+void server_schedule_session(struct server *server, struct session *session) {
+    timer_schedule(&server->timers, &session->tick_timer, session->state->next_update);
+}
+
+bool server_flush_session(struct server *server, struct session *session) {
+    if (!session_flush(session)) {
         return false;
     }
 
-    // Add the session to the list
-    session->prev = session->next = NULL;
-    if (server->sessions == NULL) {
-        server->sessions = session;
-    } else {
-        session->next = server->sessions;
-        server->sessions->prev = session;
-        server->sessions = session;
+    // Level-triggered writability fires constantly on an idle socket, so only
+    // subscribe to it while there's a backlog
+    bool const want_writable = session->outbound.len > 0;
+    if (want_writable == session->polling_writable) {
+        return true;
+    }
+
+#ifdef __linux__
+    struct epoll_event event = {
+            .events = EPOLLIN | EPOLLRDHUP | (want_writable ? EPOLLOUT : 0),
+            .data.ptr = session,
+    };
+    if (epoll_ctl(server->poll_fd, EPOLL_CTL_MOD, session->socket, &event) == -1) {
+        LOG_ERROR("epoll_ctl failed (%d: %s)", errno, strerror(errno));
+        return false;
     }
-    server->num_sessions++;
+#endif
 
+    session->polling_writable = want_writable;
     return true;
 }
 
 void server_disconnect_session(struct server *server, struct session *session) {
+    // Drop any events that haven't been handled yet
+    for (int i = server->next_event; i < server->num_events; i++) {
+        if (server->events[i].session == session) {
+            server->events[i].session = NULL;
+        }
+    }
+
+    timer_cancel(&server->timers, &session->tick_timer);
+
+    // Closing the socket implicitly removes it from the epoll set
     session_destroy(session);
 
     // Remove the session from the list
@@ -138,9 +395,10 @@ void server_disconnect_session(struct server *server, struct session *session) {
         session->next->prev = session->prev;
     }
     if (server->sessions == session) {
-        server->sessions = NULL;
+        server->sessions = session->next;
     }
     server->num_sessions--;
+    atomic_fetch_sub(&num_online_sessions, 1);
 
     free(session);
 }
@@ -159,3 +417,7 @@ bool server_next_session(struct server *server, struct session **session) {
     }
     return true;
 }
+
+size_t server_num_online_sessions(void) {
+    return atomic_load(&num_online_sessions);
+}
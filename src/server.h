@@ -6,24 +6,79 @@ extern "C" {
 #endif
 
 #include "session.h"
+#include "timer.h"
+#include "frame_cache.h"
+
+// Maximum number of readiness events handled per call to server_update
+#define SERVER_MAX_EVENTS 64
+
+// Upper bound on how long server_update sleeps, so worker threads notice a
+// shutdown even when they have nothing scheduled
+#define SERVER_MAX_WAIT_MS 1000
+
+enum server_event_flags {
+    SERVER_EVENT_READABLE = 1 << 0,
+    SERVER_EVENT_WRITABLE = 1 << 1,
+    SERVER_EVENT_CLOSED = 1 << 2,
+};
+
+struct server_event {
+    struct session *session;
+    unsigned flags;
+};
 
 struct server {
     int socket;
+    // Handle to the epoll instance, or -1 when falling back to poll()
+    int poll_fd;
+    // Descriptor held in reserve, so connections can still be accepted and
+    // turned away once we run out of them. -1 if it couldn't be opened
+    int spare_fd;
 
     size_t num_sessions;
     struct session *sessions;
+
+    // Tick deadlines of every session
+    struct timer_wheel timers;
+
+    // Frames encoded for this server's sessions, shared between the ones that
+    // are looking at the same thing
+    struct frame_cache frames;
+
+    // Session events from the last call to server_update
+    int num_events, next_event;
+    struct server_event events[SERVER_MAX_EVENTS];
 };
 
 bool server_create(struct server *server, char *service);
 
 void server_destroy(struct server *server);
 
+// Wait for activity on the listening socket or any session socket, or until
+// the next session tick is due. New connections are accepted immediately, and
+// session activity is queued to be consumed with server_next_event
 bool server_update(struct server *server);
 
+bool server_next_event(struct server *server, struct session **session, unsigned *flags);
+
+// Pop the next session whose tick is due at the given time
+bool server_next_due_session(struct server *server, uint64_t now, struct session **session);
+
+// Schedule the session's timer for its next update
+void server_schedule_session(struct server *server, struct session *session);
+
+// Flush the session's queued output, and only ask to be woken when the socket
+// becomes writable while some of it is left over. Returns false if the
+// connection was lost
+bool server_flush_session(struct server *server, struct session *session);
+
 void server_disconnect_session(struct server *server, struct session *session);
 
 bool server_next_session(struct server *server, struct session **session);
 
+// Number of sessions connected across every server in the process
+size_t server_num_online_sessions(void);
+
 #ifdef __cplusplus
 }
 #endif
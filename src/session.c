@@ -7,34 +7,76 @@
 #include <stdio.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <stdatomic.h>
+#include <zlib.h>
+#include <baro.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
 #include "session.h"
+#include "telnet.h"
+#include "util.h"
 #include "log.h"
 
+// Shared by every worker thread
 _Atomic uint64_t next_session_id = 1;
 
+// Set once on startup, before any workers are running
+static int compress_level = SESSION_DEFAULT_COMPRESS_LEVEL;
+static int compress_window_bits = SESSION_DEFAULT_COMPRESS_WINDOW_BITS;
+
+void session_set_compression(int level, int window_bits) {
+    compress_level = level;
+    compress_window_bits = window_bits;
+}
+
 bool session_create(struct session *session, int socket) {
-    session->id = next_session_id++;
+    session->id = atomic_fetch_add(&next_session_id, 1);
 
     session->socket = socket;
 
     session->state = malloc(sizeof(struct state));
     state_create(session->state);
 
+    timer_init(&session->tick_timer, session);
+
+    buffer_queue_create(&session->outbound);
+    session->polling_writable = false;
+
+    session->deflate = NULL;
+    buffer_queue_create(&session->uncompressed);
+
     // Enable non-blocking mode
     u_long mode = 1;
     ioctl(session->socket, FIONBIO, &mode);
 
+    // Frames are already coalesced into one write per tick, so holding back
+    // the tail of one for Nagle's algorithm would only add latency
+    int opt_val = 1;
+    setsockopt(session->socket, IPPROTO_TCP, TCP_NODELAY, &opt_val, sizeof(opt_val));
+
+#ifdef TCP_NOTSENT_LOWAT
+    // Keep the kernel from buffering more than a frame or so of unsent data on
+    // our behalf, so that a slow link shows up as backpressure right away
+    int lowat = SESSION_NOTSENT_LOWAT;
+    setsockopt(session->socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+#endif
+
     struct sockaddr_in addr;
     socklen_t addr_size = sizeof(struct sockaddr_in);
     if (getpeername(session->socket, (struct sockaddr *)&addr, &addr_size)) {
         LOG_ERROR("Failed to getpeername for session #%d: %s", session->id, strerror(errno));
     } else {
-        char ip[20];
-        strncpy(ip, inet_ntoa(addr.sin_addr), sizeof(ip));
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
 
         LOG_INFO("Session #%u created for %s:%d", session->id, ip, addr.sin_port);
     }
 
+    if (compress_level > 0) {
+        session_send(session, IAC WILL COMPRESS2, 3);
+    }
+
     return true;
 }
 
@@ -42,6 +84,14 @@ void session_destroy(struct session *session) {
     state_destroy(session->state);
     free(session->state);
 
+    buffer_queue_destroy(&session->outbound);
+
+    if (session->deflate != NULL) {
+        deflateEnd(session->deflate);
+        free(session->deflate);
+    }
+    buffer_queue_destroy(&session->uncompressed);
+
     // Prevent anymore sending on the socket
     int result = shutdown(session->socket, SHUT_WR);
     if (result == -1) {
@@ -92,10 +142,7 @@ bool session_receive(struct session *session, char *buf, size_t len, size_t *len
 }
 
 void session_send(struct session *session, char *buf, size_t len) {
-    if (send(session->socket, buf, (int) len, 0) == -1) {
-        LOG_ERROR("send failed (%d: %s)", errno, strerror(errno));
-        return;
-    }
+    buffer_queue_append(&session->outbound, buf, len);
 
     if (len > 4095) {
         LOG_WARN("Skipping logging sent packet because it was too long (%d bytes)", len);
@@ -113,3 +160,231 @@ void session_send(struct session *session, char *buf, size_t len) {
     }
     LOG_TRACE(buffer);
 }
+
+static void encode_canvas(struct session *session, struct frame_cache *frames,
+                          struct buffer_queue *queue) {
+    // Frames can only be shared when there's no raw output to go before them
+    struct terminal *terminal = &session->state->terminal;
+    struct canvas_flush_key key;
+    if (terminal->buffer_len == 0 && canvas_flush_key(terminal->canvas, &key)) {
+        struct frame const *frame = frame_cache_get(frames, &key);
+        if (frame != NULL) {
+            canvas_apply_flush(terminal->canvas, &frame->result);
+        }
+        else {
+            frame = frame_cache_encode(frames, terminal->canvas, &key);
+        }
+
+        buffer_queue_append(queue, frame->data, frame->len);
+        return;
+    }
+
+    size_t len;
+    do {
+        size_t avail;
+        char *buf = buffer_queue_reserve(queue, SESSION_MIN_ENCODE_LEN, &avail);
+        if (!terminal_flush(&session->state->terminal, buf, avail, &len)) {
+            break;
+        }
+        buffer_queue_commit(queue, len);
+    } while (len > 0);
+}
+
+// Compress everything in one queue onto the end of another, ending with a
+// sync flush so the client can decode all of it right away
+static void compress_queue(z_stream *stream, struct buffer_queue *in, struct buffer_queue *out) {
+    int flush = Z_NO_FLUSH;
+    do {
+        size_t in_len = 0;
+        char *in_data = buffer_queue_peek(in, &in_len);
+        if (in_data == NULL) {
+            flush = Z_SYNC_FLUSH;
+        }
+
+        stream->next_in = (Bytef *) in_data;
+        stream->avail_in = (uInt) in_len;
+
+        // Deflate stops either once it has used up the input or once it runs
+        // out of room, in which case it gets more
+        do {
+            size_t avail;
+            char *buf = buffer_queue_reserve(out, SESSION_MIN_ENCODE_LEN, &avail);
+            stream->next_out = (Bytef *) buf;
+            stream->avail_out = (uInt) avail;
+
+            int const result = deflate(stream, flush);
+            ASSERT(result != Z_STREAM_ERROR);
+
+            buffer_queue_commit(out, avail - stream->avail_out);
+        } while (stream->avail_out == 0);
+
+        if (in_len > 0) {
+            buffer_queue_consume(in, in_len);
+        }
+    } while (flush == Z_NO_FLUSH);
+}
+
+// Tell the client that compression starts now, and set up the stream for it
+static void start_compression(struct session *session) {
+    z_stream *stream = calloc(1, sizeof(z_stream));
+    ASSERT(stream != NULL);
+
+    // zlib's memory level sets the size of its hash table, which is kept in
+    // line with the window. Together they take about 2^(window bits + 3)
+    int const mem_level = SSB_CLAMP(compress_window_bits - 7, 1, MAX_MEM_LEVEL);
+    int const result = deflateInit2(stream, compress_level, Z_DEFLATED, compress_window_bits,
+                                    mem_level, Z_DEFAULT_STRATEGY);
+    if (result != Z_OK) {
+        LOG_ERROR("deflateInit2 failed (%d: %s)", result, stream->msg ? stream->msg : "?");
+        free(stream);
+        return;
+    }
+
+    LOG_DEBUG("Starting MCCP2 compression");
+    buffer_queue_append(&session->outbound, IAC SB COMPRESS2 IAC SE, 5);
+    session->deflate = stream;
+}
+
+void session_encode(struct session *session, struct frame_cache *frames) {
+    struct terminal *terminal = &session->state->terminal;
+    if (terminal->will_compress && session->deflate == NULL && compress_level > 0) {
+        start_compression(session);
+    }
+
+    struct buffer_queue *queue = session->deflate ? &session->uncompressed : &session->outbound;
+
+    // Bracket the frame so the client shows it all at once, rather than
+    // whatever part of it made it into each read
+    bool const framed = terminal->buffer_len > 0 || terminal->shared.len > 0 ||
+                        canvas_is_dirty(terminal->canvas);
+    if (framed && terminal->profile.sync_output) {
+        buffer_queue_append(queue, CSI "?2026h", 8);
+    }
+
+    encode_canvas(session, frames, queue);
+
+    // Shared output moves the cursor and changes attributes behind the
+    // canvas' back
+    if (terminal->shared.len > 0) {
+        canvas_forget_terminal_state(terminal->canvas);
+        buffer_queue_splice(queue, &terminal->shared);
+    }
+
+    // Clients without synchronized output may still hold off on drawing
+    // until they see a record or go-ahead marker
+    if (framed && terminal->profile.sync_output) {
+        buffer_queue_append(queue, CSI "?2026l", 8);
+    }
+    else if (framed && terminal->do_eor) {
+        buffer_queue_append(queue, IAC EOR, 2);
+    }
+    else if (framed && !terminal->do_sga) {
+        buffer_queue_append(queue, IAC GA, 2);
+    }
+
+    if (session->deflate != NULL && session->uncompressed.len > 0) {
+        compress_queue(session->deflate, &session->uncompressed, &session->outbound);
+    }
+}
+
+TEST("[session] compress_queue") {
+    z_stream deflater = {0};
+    REQUIRE_EQ(deflateInit2(&deflater, 6, Z_DEFLATED, 9, 2, Z_DEFAULT_STRATEGY), Z_OK);
+    z_stream inflater = {0};
+    REQUIRE_EQ(inflateInit(&inflater), Z_OK);
+
+    struct buffer_queue in, out;
+    buffer_queue_create(&in);
+    buffer_queue_create(&out);
+
+    // Each frame has to decode in full on its own, as the client gets it
+    static char frame[BUFFER_CHUNK_SIZE * 2];
+    char const pattern[] = "#####  \x1b[31m@";
+    for (int i = 0; i < 3; i++) {
+        for (size_t j = 0; j < sizeof(frame); j++) {
+            frame[j] = pattern[(j * (i + 1)) % (sizeof(pattern) - 1)];
+        }
+        buffer_queue_append(&in, frame, sizeof(frame));
+        compress_queue(&deflater, &in, &out);
+        REQUIRE_EQ(in.len, 0);
+        REQUIRE(out.len < sizeof(frame) / 4);
+
+        static char decoded[sizeof(frame) + 1];
+        inflater.next_out = (Bytef *) decoded;
+        inflater.avail_out = sizeof(decoded);
+        char *data;
+        size_t len;
+        while ((data = buffer_queue_peek(&out, &len)) != NULL) {
+            inflater.next_in = (Bytef *) data;
+            inflater.avail_in = (uInt) len;
+            REQUIRE_EQ(inflate(&inflater, Z_SYNC_FLUSH), Z_OK);
+            REQUIRE_EQ(inflater.avail_in, 0);
+            buffer_queue_consume(&out, len);
+        }
+        REQUIRE_EQ(sizeof(decoded) - inflater.avail_out, sizeof(frame));
+        REQUIRE(!memcmp(decoded, frame, sizeof(frame)));
+    }
+
+    buffer_queue_destroy(&in);
+    buffer_queue_destroy(&out);
+    deflateEnd(&deflater);
+    inflateEnd(&inflater);
+}
+
+// Don't get killed by SIGPIPE when the client hangs up mid-send
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+bool session_flush(struct session *session) {
+    while (session->outbound.len > 0) {
+        // Gather everything queued since the last flush, which is usually just
+        // this tick's frame, into a single syscall
+        struct iovec iov[SESSION_MAX_IOV];
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = buffer_queue_peek_iov(&session->outbound, iov, SESSION_MAX_IOV);
+
+        ssize_t sent_len = sendmsg(session->socket, &msg, SEND_FLAGS);
+        if (sent_len == -1) {
+            // The socket buffer is full, so wait to be told it's writable
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            else if (errno == EINTR) {
+                continue;
+            }
+
+            LOG_ERROR("sendmsg failed (%d: %s)", errno, strerror(errno));
+            return false;
+        }
+
+        // Short writes leave the rest queued for the next attempt
+        buffer_queue_consume(&session->outbound, (size_t) sent_len);
+    }
+
+    return true;
+}
+
+// Bytes sitting in the socket's send buffer that haven't been sent yet, not
+// counting ones that were sent and are only waiting to be acknowledged
+static size_t unsent_len(struct session *session) {
+#ifdef SIOCOUTQNSD
+    int len;
+    if (ioctl(session->socket, SIOCOUTQNSD, &len) == 0 && len > 0) {
+        return (size_t) len;
+    }
+#endif
+    return 0;
+}
+
+bool session_is_behind(struct session *session) {
+    // Anything left in our own queue means the kernel already refused it
+    if (session->outbound.len > 0) {
+        return true;
+    }
+
+    return unsent_len(session) > SESSION_NOTSENT_LOWAT;
+}
@@ -6,6 +6,30 @@ extern "C" {
 #endif
 
 #include "state.h"
+#include "timer.h"
+#include "buffer.h"
+#include "frame_cache.h"
+
+// Amount of data the kernel may hold that hasn't gone out on the wire yet
+// before we consider the client to be behind. Also used as TCP_NOTSENT_LOWAT,
+// so the socket only reports being writable once it's caught up again
+#define SESSION_NOTSENT_LOWAT 16384
+
+// Most buffers gathered into a single sendmsg call
+#define SESSION_MAX_IOV 64
+
+// Smallest chunk of queue space the terminal is encoded into, which must fit
+// the longest sequence the canvas emits for a single cell
+#define SESSION_MIN_ENCODE_LEN 4096
+
+// Default zlib level for MCCP2 compression, from 1 (fastest) to 9 (smallest)
+#define SESSION_DEFAULT_COMPRESS_LEVEL 6
+// Default base-two log of the deflate window. Each compressing session holds
+// about 2^(bits + 3) bytes of zlib state, so 12 costs 32 KB where zlib's own
+// default of 15 costs 256 KB. Frames rarely repeat anything further back
+#define SESSION_DEFAULT_COMPRESS_WINDOW_BITS 12
+
+struct z_stream_s;
 
 struct session {
     uint64_t id;
@@ -14,18 +38,52 @@ struct session {
 
     struct state *state;
 
+    // Fires when the state's next tick is due
+    struct timer tick_timer;
+
+    // Output that the socket hasn't accepted yet
+    struct buffer_queue outbound;
+    // Whether the server is waiting for the socket to become writable
+    bool polling_writable;
+
+    // MCCP2 stream everything is compressed through once the client agrees
+    // to it, or NULL. This tick's output waits in the uncompressed queue
+    struct z_stream_s *deflate;
+    struct buffer_queue uncompressed;
+
     struct session *prev;
     struct session *next;
 };
 
+// Set how sessions created from now on compress their output. A level of 0
+// stops offering MCCP2 to clients. Window bits range from 9 to 15
+void session_set_compression(int level, int window_bits);
+
 bool session_create(struct session *session, int socket);
 
 void session_destroy(struct session *session);
 
 bool session_receive(struct session *session, char *buf, size_t len, size_t *len_written);
 
+// Queue data to be sent on the next session_flush
 void session_send(struct session *session, char *buf, size_t len);
 
+// Encode the terminal's pending output straight into the outbound queue. If
+// the canvas is in the same state as another session's was, the frame that
+// was encoded for it is reused from the cache instead. Anything shared with
+// other sessions goes out after it. With MCCP2, the whole tick's output is
+// compressed and flushed as one block
+void session_encode(struct session *session, struct frame_cache *frames);
+
+// Send as much queued output as the socket will take without blocking.
+// Returns false if the connection was lost
+bool session_flush(struct session *session);
+
+// Check if the client hasn't taken the previous frame yet, in which case
+// intermediate frames should be skipped rather than queued. The canvas still
+// holds what was last sent, so the next frame carries every change since
+bool session_is_behind(struct session *session);
+
 #ifdef __cplusplus
 }
 #endif
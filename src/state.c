@@ -1,10 +1,10 @@
-#include <time.h>
 #include <stdio.h>
 #include "state.h"
 #include "db.h"
 #include "env.h"
 #include "server.h"
 #include "screen.h"
+#include "stream.h"
 #include "screens/title.h"
 #include "log.h"
 
@@ -13,8 +13,13 @@ bool state_create(struct state *state) {
     terminal_create(&state->terminal, &state->canvas);
 
     state->tick_ms = 100;
-    state->last_tick.tv_sec = state->last_tick.tv_nsec = 0;
+    state->next_tick = 0;
+    state->next_update = 0;
+    state->tick_time = 0;
     state->num_ticks = 0;
+    state->drawn_w = state->canvas.w;
+    state->drawn_h = state->canvas.h;
+    state->stream = NULL;
 
     state_clear_screens(state);
     state_push_screen(state, title_screen_create(state));
@@ -23,6 +28,12 @@ bool state_create(struct state *state) {
 }
 
 void state_destroy(struct state *state) {
+    // Screens may hold on to things that outlive the session otherwise, like
+    // a stream that spectators would keep watching
+    while (state->num_screens > 0) {
+        screen_destroy(state_pop_screen(state), state);
+    }
+
     terminal_destroy(&state->terminal);
     canvas_destroy(&state->canvas);
 }
@@ -38,8 +49,10 @@ bool state_push_screen(struct state *state, struct screen *screen) {
     }
 
     KEYBOARD_CLEAR(state->terminal.keyboard);
+    terminal_clear_events(&state->terminal);
 
-    canvas_erase(&state->canvas);
+    canvas_reset_layers(&state->canvas);
+    state->redraw = true;
 
     state->screens[state->num_screens++] = screen;
     return true;
@@ -50,6 +63,10 @@ void state_clear_screens(struct state *state) {
 }
 
 struct screen *state_peek_screen(struct state *state) {
+    if (state->num_screens == 0) {
+        return NULL;
+    }
+
     return state->screens[state->num_screens - 1];
 }
 
@@ -59,30 +76,84 @@ struct screen *state_pop_screen(struct state *state) {
         return NULL;
     }
 
+    // Whatever is below has to draw over what the popped screen left behind,
+    // without acting on keys that were meant for it
+    canvas_reset_layers(&state->canvas);
+    terminal_clear_events(&state->terminal);
+    state->redraw = true;
+
     return state->screens[--state->num_screens];
 }
 
-// Convert timespec to number in milliseconds
-#define TO_MS(t) ((t).tv_sec * 1000 + (t).tv_nsec / 1000000)
+// Whether the top screen only changes on input, and has some to react to
+static bool has_input(struct state *state) {
+    struct screen *screen = state_peek_screen(state);
+    if (screen == NULL || screen->impl->idle_ticks == 0) {
+        return false;
+    }
 
-bool state_update(struct state *state, struct env *env) {
-    struct timespec current;
-    clock_gettime(CLOCK_MONOTONIC, &current);
+    return state->terminal.num_events > 0 || state->redraw ||
+           state->canvas.w != state->drawn_w || state->canvas.h != state->drawn_h ||
+           canvas_is_dirty(&state->canvas);
+}
 
-    // Check if a tick has elapsed
-    long long delta = TO_MS(current) - TO_MS(state->last_tick);
-    if (delta < state->tick_ms) {
+bool state_wants_update(struct state *state, uint64_t now) {
+    return now >= state->next_update || has_input(state);
+}
+
+bool state_update(struct state *state, struct env *env, uint64_t now) {
+    // Check if a tick has elapsed, or if there's input that can't wait for it
+    if (!state_wants_update(state, now)) {
         return true;
     }
 
-    state->last_tick = current;
-    state->num_ticks++;
+    // Advance the deadline by whole ticks rather than from the current time,
+    // so late wakeups don't accumulate into drift. If we fell more than a tick
+    // behind (or a screen was idle), count the missed ticks instead of
+    // bursting through them
+    uint64_t const tick_ns = (uint64_t) state->tick_ms * 1000000ull;
+    if (state->next_tick == 0) {
+        state->next_tick = now;
+    }
+    if (now >= state->next_tick) {
+        uint64_t const elapsed = (now - state->next_tick) / tick_ns + 1;
+        state->next_tick += elapsed * tick_ns;
+        state->num_ticks += elapsed;
+
+        terminal_tick(&state->terminal);
+    }
+    state->tick_time = now;
+
+    if (state->canvas.w != state->drawn_w || state->canvas.h != state->drawn_h) {
+        state->drawn_w = state->canvas.w;
+        state->drawn_h = state->canvas.h;
+        state->redraw = true;
+    }
 
     struct screen *screen;
-    while ((screen = state_peek_screen(state)) &&
-            screen != NULL && !screen_update(screen, state, env)) {
+    while ((screen = state_peek_screen(state)) != NULL) {
+        int const num_screens = state->num_screens;
+        if (screen_update(screen, state, env)) {
+            // A screen pushed during the update still has to draw itself
+            if (state->num_screens == num_screens) {
+                state->redraw = false;
+            }
+            break;
+        }
+
         screen_destroy(state_pop_screen(state), state);
     }
 
+    if (state->stream != NULL) {
+        stream_publish(state->stream, &state->canvas);
+    }
+
+    // Screens that only change on input sleep until then, apart from waking
+    // up every so often
+    state->next_update = state->next_tick;
+    if (screen != NULL && screen->impl->idle_ticks > 0) {
+        state->next_update += (screen->impl->idle_ticks - 1) * tick_ns;
+    }
+
     return (screen != NULL);
 }
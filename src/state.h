@@ -13,6 +13,7 @@ extern "C" {
 #include "env.h"
 
 struct screen;
+struct stream;
 
 #define MAX_SCREENS 16
 
@@ -21,11 +22,29 @@ struct state {
     struct terminal terminal;
 
     long long tick_ms;
-    struct timespec last_tick;
+    // Deadline of the next tick, in nanoseconds of CLOCK_MONOTONIC
+    uint64_t next_tick;
+    // When the screens next have to be updated if no input arrives before
+    // then, which is the next tick unless the top screen is idle
+    uint64_t next_update;
+    // Time of the latest update
+    uint64_t tick_time;
     size_t num_ticks;
 
+    // Set when the top screen has to draw itself from scratch: it was just
+    // pushed, the screen above it was popped, or the canvas was resized.
+    // Otherwise screens keep what they drew last tick and only touch the
+    // cells that changed, so untouched rows are left out of the next flush
+    bool redraw;
+    // Canvas size the screens last drew for
+    unsigned drawn_w, drawn_h;
+
     int num_screens;
     struct screen *screens[MAX_SCREENS];
+
+    // Where the canvas is broadcast to spectators after every tick, if
+    // anywhere. Set by screens worth watching
+    struct stream *stream;
 };
 
 struct db;
@@ -44,7 +63,13 @@ struct screen *state_peek_screen(struct state *state);
 
 struct screen *state_pop_screen(struct state *state);
 
-bool state_update(struct state *state, struct env *env);
+// Whether state_update has anything to do at the given time
+bool state_wants_update(struct state *state, uint64_t now);
+
+// Run a tick if one is due at the given time (see timer_now), or update a
+// screen that reacts to input right away if there is some. Returns false once
+// the last screen has exited
+bool state_update(struct state *state, struct env *env, uint64_t now);
 
 #ifdef __cplusplus
 }
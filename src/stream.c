@@ -0,0 +1,453 @@
+#include <baro.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stream.h"
+#include "log.h"
+
+// Every live stream, along with every stream's reference count
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stream *streams = NULL;
+static uint64_t next_stream_id = 1;
+
+static void view_destroy(struct stream_view *view) {
+    for (size_t i = 0; i < STREAM_MAX_FRAMES; i++) {
+        if (view->frames[i] != NULL) {
+            buffer_destroy(view->frames[i]);
+        }
+    }
+
+    canvas_destroy(&view->canvas);
+    free(view);
+}
+
+static void stream_free(struct stream *stream) {
+    for (size_t i = 0; i < stream->num_views; i++) {
+        view_destroy(stream->views[i]);
+    }
+
+    canvas_destroy(&stream->canvas);
+    pthread_mutex_destroy(&stream->lock);
+    free(stream);
+}
+
+struct stream *stream_open(unsigned w, unsigned h) {
+    struct stream *stream = calloc(1, sizeof(struct stream));
+    ASSERT(stream != NULL);
+
+    pthread_mutex_init(&stream->lock, NULL);
+    canvas_create(&stream->canvas, w, h);
+    stream->refs = 1;
+    stream->live = true;
+
+    pthread_mutex_lock(&streams_lock);
+    stream->id = next_stream_id++;
+    stream->next = streams;
+    if (streams != NULL) {
+        streams->prev = stream;
+    }
+    streams = stream;
+    pthread_mutex_unlock(&streams_lock);
+
+    return stream;
+}
+
+void stream_close(struct stream *stream) {
+    pthread_mutex_lock(&streams_lock);
+    if (stream->prev != NULL) {
+        stream->prev->next = stream->next;
+    }
+    else {
+        streams = stream->next;
+    }
+    if (stream->next != NULL) {
+        stream->next->prev = stream->prev;
+    }
+    stream->live = false;
+    bool const last = (--stream->refs == 0);
+    pthread_mutex_unlock(&streams_lock);
+
+    if (last) {
+        stream_free(stream);
+    }
+}
+
+struct stream *stream_find(uint64_t id, bool backwards) {
+    pthread_mutex_lock(&streams_lock);
+
+    // Closest stream in the given direction, or failing that, the one furthest
+    // in the other direction to wrap around to
+    struct stream *found = NULL, *wrapped = NULL;
+    for (struct stream *stream = streams; stream != NULL; stream = stream->next) {
+        if (!backwards) {
+            if (stream->id > id && (found == NULL || stream->id < found->id)) {
+                found = stream;
+            }
+            if (wrapped == NULL || stream->id < wrapped->id) {
+                wrapped = stream;
+            }
+        }
+        else {
+            if (stream->id < id && (found == NULL || stream->id > found->id)) {
+                found = stream;
+            }
+            if (wrapped == NULL || stream->id > wrapped->id) {
+                wrapped = stream;
+            }
+        }
+    }
+
+    if (found == NULL) {
+        found = wrapped;
+    }
+    if (found != NULL) {
+        found->refs++;
+    }
+
+    pthread_mutex_unlock(&streams_lock);
+    return found;
+}
+
+void stream_release(struct stream *stream) {
+    pthread_mutex_lock(&streams_lock);
+    bool const last = (--stream->refs == 0);
+    pthread_mutex_unlock(&streams_lock);
+
+    if (last) {
+        stream_free(stream);
+    }
+}
+
+bool stream_is_live(struct stream *stream) {
+    pthread_mutex_lock(&streams_lock);
+    bool const live = stream->live;
+    pthread_mutex_unlock(&streams_lock);
+    return live;
+}
+
+// Offset that centers something of the given size within another, the same
+// way screens center what they draw
+static unsigned centered(unsigned outer, unsigned inner) {
+    return outer > inner ? (outer - inner) / 2 : 0;
+}
+
+// Flush a canvas into a buffer of its own, or return NULL if there was nothing
+// to flush
+static struct buffer *encode_frame(struct canvas *canvas) {
+    struct buffer *frame = buffer_create(BUFFER_CHUNK_SIZE);
+    size_t len;
+    while (canvas_flush(canvas, frame->data + frame->len, frame->cap - frame->len, &len)) {
+        frame->len += len;
+
+        // Make room for the rest, since the whole screen may not fit
+        if (frame->cap - frame->len < BUFFER_CHUNK_SIZE / 2) {
+            struct buffer *bigger = buffer_create(frame->cap * 2);
+            memcpy(bigger->data, frame->data, frame->len);
+            bigger->len = frame->len;
+            buffer_destroy(frame);
+            frame = bigger;
+        }
+    }
+
+    // Frames are held on to for a while, so don't keep the spare room
+    struct buffer *exact = NULL;
+    if (frame->len > 0) {
+        exact = buffer_create(frame->len);
+        memcpy(exact->data, frame->data, frame->len);
+        exact->len = frame->len;
+    }
+    buffer_destroy(frame);
+    return exact;
+}
+
+// Find how the stream is encoded for a spectator's canvas, or NULL if it isn't
+static struct stream_view *find_view(struct stream *stream, struct canvas *canvas) {
+    unsigned const x = centered(canvas->w, stream->canvas.w);
+    unsigned const y = centered(canvas->h, stream->canvas.h);
+    bool const latin1 = canvas->features & CANVAS_FEATURE_LATIN1;
+    for (size_t i = 0; i < stream->num_views; i++) {
+        struct stream_view *view = stream->views[i];
+        if (view->x == x && view->y == y && view->latin1 == latin1) {
+            return view;
+        }
+    }
+    return NULL;
+}
+
+// Start encoding the stream for a spectator's canvas, making room by dropping
+// whichever view was read from least recently
+static struct stream_view *create_view(struct stream *stream, struct canvas *canvas) {
+    if (stream->num_views == STREAM_MAX_VIEWS) {
+        size_t oldest = 0;
+        for (size_t i = 1; i < stream->num_views; i++) {
+            if (stream->views[i]->next_read < stream->views[oldest]->next_read) {
+                oldest = i;
+            }
+        }
+        view_destroy(stream->views[oldest]);
+        stream->views[oldest] = stream->views[--stream->num_views];
+    }
+
+    struct stream_view *view = calloc(1, sizeof(struct stream_view));
+    ASSERT(view != NULL);
+
+    unsigned const w = stream->canvas.w, h = stream->canvas.h;
+    view->x = centered(canvas->w, w);
+    view->y = centered(canvas->h, h);
+    view->latin1 = canvas->features & CANVAS_FEATURE_LATIN1;
+    canvas_create(&view->canvas, view->x + w, view->y + h);
+    canvas_set_features(&view->canvas, CANVAS_DEFAULT_FEATURES |
+                                       (view->latin1 ? CANVAS_FEATURE_LATIN1 : 0));
+    canvas_copy(&view->canvas, view->x, view->y, &stream->canvas, 0, 0, w, h);
+    view->first_frame = view->next_read = stream->num_frames;
+
+    stream->views[stream->num_views++] = view;
+    return view;
+}
+
+void stream_publish(struct stream *stream, struct canvas *canvas) {
+    pthread_mutex_lock(&stream->lock);
+
+    unsigned const w = stream->canvas.w, h = stream->canvas.h;
+    if (!canvas_copy(&stream->canvas, 0, 0, canvas, centered(canvas->w, w),
+                     centered(canvas->h, h), w, h)) {
+        pthread_mutex_unlock(&stream->lock);
+        return;
+    }
+
+    uint64_t const frame = stream->num_frames++;
+    for (size_t i = 0; i < stream->num_views;) {
+        struct stream_view *view = stream->views[i];
+
+        // Everyone watching this way has left, or fallen so far behind that
+        // they'll need a keyframe anyway
+        if (frame - view->next_read >= STREAM_MAX_FRAMES) {
+            view_destroy(view);
+            stream->views[i] = stream->views[--stream->num_views];
+            continue;
+        }
+
+        canvas_copy(&view->canvas, view->x, view->y, &stream->canvas, 0, 0, w, h);
+
+        // Spectators may have tuned in with a keyframe since the last frame,
+        // so don't count on the cursor or attributes being where it left them
+        canvas_forget_terminal_state(&view->canvas);
+
+        struct buffer **slot = &view->frames[frame % STREAM_MAX_FRAMES];
+        if (*slot != NULL) {
+            buffer_destroy(*slot);
+        }
+        *slot = encode_frame(&view->canvas);
+        i++;
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+}
+
+void stream_keyframe(struct stream *stream, struct canvas *canvas, struct buffer_queue *queue,
+                     uint64_t *next_frame) {
+    pthread_mutex_lock(&stream->lock);
+
+    // Flushing a fresh canvas sends every cell, and a new view's canvas is
+    // just that
+    struct buffer *keyframe;
+    struct stream_view *view = find_view(stream, canvas);
+    if (view == NULL) {
+        view = create_view(stream, canvas);
+        keyframe = encode_frame(&view->canvas);
+    }
+    else {
+        struct canvas fresh;
+        canvas_create(&fresh, view->canvas.w, view->canvas.h);
+        canvas_set_features(&fresh, view->canvas.features);
+        canvas_copy(&fresh, 0, 0, &view->canvas, 0, 0, view->canvas.w, view->canvas.h);
+        keyframe = encode_frame(&fresh);
+        canvas_destroy(&fresh);
+    }
+
+    if (keyframe != NULL) {
+        buffer_queue_append_buffer(queue, keyframe);
+        buffer_destroy(keyframe);
+    }
+    *next_frame = view->next_read = stream->num_frames;
+
+    pthread_mutex_unlock(&stream->lock);
+}
+
+bool stream_read(struct stream *stream, struct canvas *canvas, struct buffer_queue *queue,
+                 uint64_t *next_frame) {
+    // Leave the frames where they are until the spectator is ready for them,
+    // so that one who can't keep up falls behind and gets a keyframe
+    if (queue->len > 0) {
+        return true;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+
+    struct stream_view *view = find_view(stream, canvas);
+    bool const caught_up = view != NULL && *next_frame >= view->first_frame &&
+                           stream->num_frames - *next_frame <= STREAM_MAX_FRAMES;
+    if (caught_up) {
+        for (; *next_frame < stream->num_frames; (*next_frame)++) {
+            struct buffer *frame = view->frames[*next_frame % STREAM_MAX_FRAMES];
+            if (frame != NULL) {
+                buffer_queue_append_buffer(queue, frame);
+            }
+        }
+        view->next_read = *next_frame;
+    }
+
+    pthread_mutex_unlock(&stream->lock);
+    return caught_up;
+}
+
+TEST("[stream] stream") {
+    // The field sits in the middle of a player's wide window
+    struct canvas player;
+    canvas_create(&player, 16, 4);
+    canvas_write(&player, 4, 1, "player");
+
+    struct stream *stream = stream_open(8, 2);
+
+    // Spectators with screens the size of the field, and one that's wider
+    struct canvas small, wide;
+    canvas_create(&small, 8, 2);
+    canvas_create(&wide, 12, 2);
+
+    struct buffer_queue a, b;
+    buffer_queue_create(&a);
+    buffer_queue_create(&b);
+    uint64_t next_a = 0, next_b = 0;
+
+    SUBTEST("spectators are found by ID and wrap around") {
+        struct stream *found = stream_find(0, false);
+        REQUIRE_EQ(found, stream);
+        stream_release(found);
+
+        found = stream_find(stream->id, true);
+        REQUIRE_EQ(found, stream);
+        stream_release(found);
+    }
+
+    SUBTEST("only the field is shown, centered on each spectator's screen") {
+        stream_publish(stream, &player);
+        stream_keyframe(stream, &small, &a, &next_a);
+        stream_keyframe(stream, &wide, &b, &next_b);
+        REQUIRE_EQ(stream->num_views, 2);
+
+        char *data;
+        size_t len;
+        data = buffer_queue_peek(&a, &len);
+        REQUIRE(len > 8);
+        REQUIRE(!memcmp(data, "\x1b[1;1H\x1b[mplayer", 8));
+        data = buffer_queue_peek(&b, &len);
+        REQUIRE(!memcmp(data, "\x1b[1;1H\x1b[m  player", 17));
+
+        buffer_queue_consume(&a, a.len);
+        buffer_queue_consume(&b, b.len);
+    }
+
+    SUBTEST("frames are shared between spectators with screens of the same size") {
+        struct canvas other;
+        canvas_create(&other, 8, 2);
+        struct buffer_queue c;
+        buffer_queue_create(&c);
+        uint64_t next_c = next_a;
+
+        canvas_put(&player, 4, 2, '!');
+        stream_publish(stream, &player);
+        REQUIRE(stream_read(stream, &small, &a, &next_a));
+        REQUIRE(stream_read(stream, &other, &c, &next_c));
+        REQUIRE(a.len > 0);
+        REQUIRE(a.len < 16);
+        REQUIRE_EQ(a.len, c.len);
+
+        char *data_a, *data_c;
+        size_t len;
+        data_a = buffer_queue_peek(&a, &len);
+        data_c = buffer_queue_peek(&c, &len);
+        REQUIRE_EQ(data_a, data_c);
+
+        buffer_queue_consume(&a, a.len);
+        buffer_queue_destroy(&c);
+        canvas_destroy(&other);
+    }
+
+    SUBTEST("changes outside the field aren't published") {
+        uint64_t const num_frames = stream->num_frames;
+        canvas_put(&player, 0, 0, '?');
+        stream_publish(stream, &player);
+        REQUIRE_EQ(stream->num_frames, num_frames);
+    }
+
+    SUBTEST("spectators that don't take their frames fall behind") {
+        canvas_put(&player, 4, 1, 'a');
+        stream_publish(stream, &player);
+        REQUIRE(stream_read(stream, &small, &a, &next_a));
+        size_t const len = a.len;
+        REQUIRE(len > 0);
+
+        for (int i = 0; i < STREAM_MAX_FRAMES + 1; i++) {
+            canvas_put(&player, 4, 1, 'b' + i % 2);
+            stream_publish(stream, &player);
+            REQUIRE(stream_read(stream, &small, &a, &next_a));
+            REQUIRE_EQ(a.len, len);
+        }
+
+        buffer_queue_consume(&a, a.len);
+        REQUIRE_FALSE(stream_read(stream, &small, &a, &next_a));
+
+        stream_keyframe(stream, &small, &a, &next_a);
+        REQUIRE(a.len > 0);
+        REQUIRE_EQ(next_a, stream->num_frames);
+        REQUIRE(stream_read(stream, &small, &a, &next_a));
+    }
+
+    SUBTEST("views nobody reads from are dropped") {
+        REQUIRE_EQ(stream->num_views, 1);
+        REQUIRE_FALSE(stream_read(stream, &wide, &b, &next_b));
+    }
+
+    SUBTEST("spectators get frames in their character set") {
+        buffer_queue_consume(&a, a.len);
+
+        struct canvas latin1;
+        canvas_create(&latin1, 8, 2);
+        canvas_set_features(&latin1, CANVAS_DEFAULT_FEATURES | CANVAS_FEATURE_LATIN1);
+        struct buffer_queue c;
+        buffer_queue_create(&c);
+        uint64_t next_c;
+        stream_keyframe(stream, &latin1, &c, &next_c);
+        REQUIRE_EQ(stream->num_views, 2);
+        buffer_queue_consume(&c, c.len);
+
+        canvas_put(&player, 4, 1, 0xa3);
+        stream_publish(stream, &player);
+        REQUIRE(stream_read(stream, &small, &a, &next_a));
+        REQUIRE(stream_read(stream, &latin1, &c, &next_c));
+
+        // The same frame, but for the pound sign
+        char *data;
+        size_t len;
+        data = buffer_queue_peek(&a, &len);
+        REQUIRE(len > 2);
+        REQUIRE(!memcmp(data + len - 2, "\xc2\xa3", 2));
+        data = buffer_queue_peek(&c, &len);
+        REQUIRE_EQ(len, a.len - 1);
+        REQUIRE(!memcmp(data + len - 1, "\xa3", 1));
+
+        buffer_queue_consume(&a, a.len);
+        buffer_queue_destroy(&c);
+        canvas_destroy(&latin1);
+    }
+
+    SUBTEST("closed streams can't be found") {
+        stream_close(stream);
+        REQUIRE_EQ(stream_find(0, false), NULL);
+    }
+
+    buffer_queue_destroy(&a);
+    buffer_queue_destroy(&b);
+    canvas_destroy(&small);
+    canvas_destroy(&wide);
+    canvas_destroy(&player);
+}
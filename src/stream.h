@@ -0,0 +1,100 @@
+#ifndef SSB_STREAM_H
+#define SSB_STREAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "canvas.h"
+#include "buffer.h"
+
+// Number of frames kept for spectators that haven't picked them up yet. Ones
+// that fall further behind start over from a keyframe
+#define STREAM_MAX_FRAMES 64
+
+// Most ways a stream is encoded at once. Spectators with screens of the same
+// size and character set share one
+#define STREAM_MAX_VIEWS 8
+
+// The game as encoded for spectators with screens of one size and character set
+struct stream_view {
+    // Where the field is centered on their screens
+    unsigned x, y;
+    // Whether they take Latin-1 instead of UTF-8
+    bool latin1;
+
+    // Their screens, with the field drawn at (x, y)
+    struct canvas canvas;
+
+    // Encoded frames, with frame n at n % STREAM_MAX_FRAMES. Ones from before
+    // the view was created don't exist, and ones where nothing changed are NULL
+    struct buffer *frames[STREAM_MAX_FRAMES];
+    uint64_t first_frame;
+
+    // Frame after the last one anyone picked up, so that views nobody is
+    // using anymore can be dropped
+    uint64_t next_read;
+};
+
+// A game being played, encoded once per tick and broadcast to everyone
+// watching it. Streams are shared between worker threads, so spectators on
+// any of them can watch players on any other
+struct stream {
+    uint64_t id;
+
+    pthread_mutex_t lock;
+
+    // Held by the player and each spectator. Guarded by the list of streams
+    unsigned refs;
+    // Whether the player is still around
+    bool live;
+
+    // The field, as cut out of the middle of the player's canvas
+    struct canvas canvas;
+
+    struct stream_view *views[STREAM_MAX_VIEWS];
+    size_t num_views;
+    uint64_t num_frames;
+
+    struct stream *prev, *next;
+};
+
+// Start broadcasting a game played on a field of the given size, making it
+// visible to spectators
+struct stream *stream_open(unsigned w, unsigned h);
+
+// Stop broadcasting, leaving the stream to whoever is still watching it
+void stream_close(struct stream *stream);
+
+// Find the live stream after (or before, if backwards) the one with the given
+// ID, wrapping around, or NULL if there are none. Returns a new reference
+struct stream *stream_find(uint64_t id, bool backwards);
+
+// Drop a reference returned by stream_find
+void stream_release(struct stream *stream);
+
+bool stream_is_live(struct stream *stream);
+
+// Encode the field centered on the player's canvas as the next frame
+void stream_publish(struct stream *stream, struct canvas *canvas);
+
+// Queue the whole picture for a spectator who is just tuning in, centered on
+// their canvas and in its character set, and set *next_frame to the first frame that comes after it
+void stream_keyframe(struct stream *stream, struct canvas *canvas, struct buffer_queue *queue,
+                     uint64_t *next_frame);
+
+// Queue the frames from *next_frame onwards for a spectator without copying
+// them, unless the queue still holds ones it hasn't sent. Returns false if some
+// of them were already dropped, in which case the spectator needs a keyframe
+// instead
+bool stream_read(struct stream *stream, struct canvas *canvas, struct buffer_queue *queue,
+                 uint64_t *next_frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SSB_STREAM_H
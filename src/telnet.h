@@ -9,8 +9,12 @@ extern "C" {
 
 #define ECHO "\x01" // 1
 #define SUPPRESS_GO_AHEAD "\x03" // 3
+#define TIMING_MARK "\x06" // 6
+#define TERMINAL_TYPE "\x18" // 24
+#define END_OF_RECORD "\x19" // 25
 #define NAWS "\x1f" // 31
 #define TERMINAL_SPEED "\x20" // 32
+#define COMPRESS2 "\x56" // 86
 
 #define CSI ESC "["
 
@@ -1,10 +1,13 @@
 #include <string.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <baro.h>
 #include "terminal.h"
 #include "session.h"
 #include "telnet.h"
 #include "util.h"
+#include "escape.h"
+#include "timer.h"
 #include "log.h"
 
 bool terminal_create(struct terminal *terminal, struct canvas *canvas) {
@@ -13,254 +16,569 @@ bool terminal_create(struct terminal *terminal, struct canvas *canvas) {
     terminal->buffer_len = terminal->buffer_flushed_len = 0;
 
     terminal->keyboard = (struct keyboard_input){0};
+    terminal->events_head = terminal->num_events = 0;
 
     terminal->will_naws = false;
+    terminal->will_compress = false;
+    terminal->do_eor = terminal->do_sga = false;
+    terminal->profile = (struct terminal_profile){.utf8 = true};
+    terminal->num_ttype_requests = 0;
+
+    terminal->parse_state = TERMINAL_PARSE_GROUND;
+    terminal->parse_time = 0;
+    terminal->parse_data_len = 0;
+    terminal->parse_idle = false;
+
+    buffer_queue_create(&terminal->shared);
+    terminal->resynced = false;
 
     return true;
 }
 
 void terminal_destroy(struct terminal *terminal) {
-
+    buffer_queue_destroy(&terminal->shared);
 }
 
-// Parse a 16-bit value from the buffer. This obviously requires at least
-// 2 bytes, but may require up to 4 as 0xFF/IAC must be escaped.
-static bool parse_escaped_u16(char **buf, size_t *len, uint16_t *out) {
-    if (*len < 2) {
-        return false;
+char const *negotiable_option_names[256] = {
+        // Binary Transmission
+        [0] = "BINARY",
+        [1] = "ECHO",
+        // Suppress Go-Ahead: https://www.rfc-editor.org/rfc/rfc858.html
+        [3] = "SGA",
+        // Status: https://www.rfc-editor.org/rfc/rfc859.html
+        [5] = "STATUS",
+        // Timing Mark: https://www.rfc-editor.org/rfc/rfc860.html
+        [6] = "TIMING-MARK",
+        // Terminal Type: https://www.rfc-editor.org/rfc/rfc1091.html
+        [24] = "TERMINAL-TYPE",
+        // End of Record: https://www.rfc-editor.org/rfc/rfc885.html
+        [25] = "END-OF-RECORD",
+        // Negotiate About Window Size: https://www.rfc-editor.org/rfc/rfc1073.html
+        [31] = "NAWS",
+        // Terminal Speed: https://www.rfc-editor.org/rfc/rfc1079.html
+        [32] = "TERMINAL-SPEED",
+        // Remote Flow Control: https://www.rfc-editor.org/rfc/rfc1372.html
+        [33] = "TOGGLE-FLOW-CONTROL",
+        // Line Mode: https://www.rfc-editor.org/rfc/rfc1184.html
+        [34] = "LINEMODE",
+        // New Environment Option: https://www.rfc-editor.org/rfc/rfc1572.html
+        [39] = "NEW-ENVIRON",
+        // Mud Client Compression Protocol v2: https://tintin.mudhalla.net/protocols/mccp/
+        [86] = "COMPRESS2",
+};
+
+static void request_terminal_type(struct terminal *terminal) {
+    if (terminal->num_ttype_requests < TERMINAL_MAX_TTYPE_REQUESTS) {
+        terminal->num_ttype_requests++;
+        terminal_write(terminal, IAC SB TERMINAL_TYPE "\x01" IAC SE);
     }
+}
 
-    char *working_buf = *buf;
-    size_t working_len = *len;
+// Terminals that are known to support more than their terminal type lets on.
+// Types are matched by prefix
+static struct {
+    char const *type;
+    bool rep;
+    bool sync_output;
+} const known_terminals[] = {
+        {"xterm-kitty", true, true},
+        {"foot", true, true},
+        {"wezterm", true, true},
+        {"contour", true, true},
+        {"alacritty", true, true},
+        {"xterm-ghostty", true, true},
+};
 
-    if (working_buf[0] == '\xff') {
-        // 0xFF only makes sense when it's doubled/escaped
-        if (working_len < 3 || working_buf[1] != '\xff') {
-            return false;
-        }
-        working_buf += 1;
-        working_len -= 1;
+// MTTS bits: https://tintin.mudhalla.net/protocols/mtts/
+#define MTTS_UTF8 4
+
+// Pick the canvas' encodings from what the client supports
+static void apply_profile(struct terminal *terminal) {
+    struct terminal_profile const *profile = &terminal->profile;
+
+    unsigned features = CANVAS_DEFAULT_FEATURES;
+    if (profile->rep) {
+        features |= CANVAS_FEATURE_REP;
+    }
+    if (!profile->utf8) {
+        features |= CANVAS_FEATURE_LATIN1;
     }
+    canvas_set_features(terminal->canvas, features);
+}
 
-    uint16_t result = (uint8_t)(working_buf[0]) << 8;
-    working_buf += 1;
-    working_len -= 1;
+// IAC SB TERMINAL-TYPE IS <type> IAC SE. MTTS clients answer each request
+// with the next of their client name, terminal type and "MTTS <bits>", and
+// then repeat the last one
+static void parse_terminal_type(struct terminal *terminal, char const *data, size_t len) {
+    char type[sizeof(terminal->profile.type)];
+    len = SSB_MIN(len, sizeof(type) - 1);
+    for (size_t i = 0; i < len; i++) {
+        type[i] = (char) tolower((unsigned char) data[i]);
+    }
+    type[len] = '\0';
 
-    if (working_buf[0] == '\xff') {
-        if (working_len < 2 || working_buf[1] != '\xff') {
-            return false;
+    LOG_DEBUG("Received terminal type: %s", type);
+
+    // Repeating itself means the client has nothing more to say
+    bool const repeated = !strcmp(type, terminal->profile.type);
+    memcpy(terminal->profile.type, type, sizeof(type));
+
+    unsigned bits;
+    if (sscanf(type, "mtts %u", &bits) == 1) {
+        terminal->profile.utf8 = (bits & MTTS_UTF8) != 0;
+    }
+    else {
+        for (size_t i = 0; i < sizeof(known_terminals) / sizeof(known_terminals[0]); i++) {
+            if (!strncmp(type, known_terminals[i].type, strlen(known_terminals[i].type))) {
+                terminal->profile.rep |= known_terminals[i].rep;
+                terminal->profile.sync_output |= known_terminals[i].sync_output;
+            }
+        }
+
+        if (!repeated) {
+            request_terminal_type(terminal);
         }
-        working_buf += 1;
-        working_len -= 1;
     }
 
-    result |= (uint8_t)(working_buf[0]);
-    working_buf += 1;
-    working_len -= 1;
+    apply_profile(terminal);
+}
 
-    *buf = working_buf;
-    *len = working_len;
-    *out = result;
-    return true;
+static void parse_negotiation(struct terminal *terminal, char action, uint8_t option_code) {
+    char const * const option_name = negotiable_option_names[option_code];
+    LOG_DEBUG("Received Telnet negotiation: IAC %s %s(%u)",
+              action == *WILL ? "WILL" : action == *WONT ? "WONT" : action == *DO ? "DO" : action == *DONT ? "DONT" : "???",
+              option_name == NULL ? "???" : option_name,
+              option_code);
+
+    // "Negotiate About Window Size"
+    if (option_code == (uint8_t) *NAWS) {
+        terminal->will_naws = (action == *WILL);
+    }
+    // The client agreed to compress our output, which starts with the next
+    // thing we send
+    else if (option_code == (uint8_t) *COMPRESS2) {
+        terminal->will_compress = (action == *DO);
+    }
+    // Ask what the client is, to find out which sequences it supports
+    else if (option_code == (uint8_t) *TERMINAL_TYPE && action == *WILL) {
+        request_terminal_type(terminal);
+    }
+    // Whether to mark the end of each frame, and how
+    else if (option_code == (uint8_t) *END_OF_RECORD && (action == *DO || action == *DONT)) {
+        terminal->do_eor = (action == *DO);
+    }
+    else if (option_code == (uint8_t) *SUPPRESS_GO_AHEAD && (action == *DO || action == *DONT)) {
+        terminal->do_sga = (action == *DO);
+    }
+    // Clients ask for a timing mark to check that we're keeping up, so
+    // answer it and make sure what they see is correct while we're at it
+    else if (option_code == (uint8_t) *TIMING_MARK && action == *DO) {
+        terminal_write(terminal, IAC WILL TIMING_MARK);
+        terminal_resync(terminal);
+    }
 }
 
-TEST("[terminal] parse_escaped_u16") {
-    {
-        uint8_t data[2] = {0x43, 0x21};
+static void parse_subnegotiation(struct terminal *terminal, uint8_t option_code,
+                                 uint8_t const *data, size_t len) {
+    char const * const option_name = negotiable_option_names[option_code];
+    LOG_DEBUG("Received Telnet sub-negotiation: IAC SB %s(%u) ...",
+              option_name == NULL ? "???" : option_name,
+              option_code);
 
-        char *buf = (char *) data;
-        size_t len = 2;
-        uint16_t out = 0x1337;
-        REQUIRE(parse_escaped_u16(&buf, &len, &out));
-        REQUIRE_EQ(buf, &data[2]);
-        REQUIRE_EQ(len, 0);
-        REQUIRE_EQ(out, 0x4321);
+    if (option_code == (uint8_t) *TERMINAL_TYPE && len >= 1 && data[0] == 0) {
+        parse_terminal_type(terminal, (char const *) data + 1, len - 1);
     }
+    // IAC SB NAWS <cols> <rows> IAC SE, with escaped IACs already undone
+    else if (option_code == (uint8_t) *NAWS && len == 4) {
+        uint16_t const cols = data[0] << 8 | data[1];
+        uint16_t const rows = data[2] << 8 | data[3];
+
+        LOG_DEBUG("Received NAWS: %d cols, %d rows", cols, rows);
+
+        // The canvas must be at least 80x25 to render the game, so we
+        // blissfully ignore any smaller windows. We need an upperbound
+        // as well to prevent DoSing
+        uint16_t clamped_cols = SSB_CLAMP(cols, COLUMNS, 200);
+        uint16_t clamped_rows = SSB_CLAMP(rows, ROWS, 200);
+        if (clamped_cols != cols || clamped_rows != rows) {
+            LOG_INFO("Clamping NAWS resolution (%d cols, %d rows) to %d cols, %d rows",
+                    cols, rows, clamped_cols, clamped_rows);
+        }
 
-    // A single/un-escaped 0xFF is invalid
-    {
-        uint8_t data[3] = {0xff, 0x12, 0x34};
+        canvas_resize(terminal->canvas, clamped_cols, clamped_rows);
 
-        char *buf = (char *)data;
-        size_t len = 3;
-        uint16_t out = 0x1337;
-        REQUIRE_FALSE(parse_escaped_u16(&buf, &len, &out));
+        // Terminals reflow or clip their contents when resized, so we
+        // can't trust what's on the screen anymore
+        terminal_resync(terminal);
     }
+}
+
+static void push_event(struct terminal *terminal, unsigned key) {
+    if (terminal->num_events == TERMINAL_MAX_EVENTS) {
+        return;
+    }
+
+    size_t const i = (terminal->events_head + terminal->num_events++) % TERMINAL_MAX_EVENTS;
+    terminal->events[i] = (struct input_event){
+            .time = terminal->parse_time,
+            .key = key,
+    };
+}
 
-    {
-        uint8_t data[4] = {0xff, 0xff, 0xff, 0xff};
+// Reply to a DEC private mode query (DECRQM): CSI ? <mode> ; <value> $ y
+static void parse_mode_report(struct terminal *terminal, char const *data, size_t len) {
+    char params[TERMINAL_MAX_SB_LEN + 1];
+    memcpy(params, data, len);
+    params[len] = '\0';
 
-        char *buf = (char *) data;
-        size_t len = 4;
-        uint16_t out = 0x1337;
-        REQUIRE(parse_escaped_u16(&buf, &len, &out));
-        REQUIRE_EQ(buf, &data[4]);
-        REQUIRE_EQ(len, 0);
-        REQUIRE_EQ(out, 0xffff);
+    unsigned mode, value;
+    char end;
+    if (sscanf(params, "?%u;%u%c", &mode, &value, &end) != 3 || end != '$') {
+        return;
     }
 
-    {
-        uint8_t data[3] = {0x12, 0xff, 0xff};
+    LOG_DEBUG("Received DECRPM: mode %u is %u", mode, value);
 
-        char *buf = (char *) data;
-        size_t len = 3;
-        uint16_t out = 0x1337;
-        REQUIRE(parse_escaped_u16(&buf, &len, &out));
-        REQUIRE_EQ(buf, &data[3]);
-        REQUIRE_EQ(len, 0);
-        REQUIRE_EQ(out, 0x12ff);
+    // Synchronized output is supported if it's either set or reset, rather
+    // than unrecognized (0) or permanently one way (3 or 4)
+    if (mode == 2026) {
+        terminal->profile.sync_output = (value == 1 || value == 2);
     }
 }
 
-char const *negotiable_option_names[256] = {
-        // Binary Transmission
-        [0] = "BINARY",
-        [1] = "ECHO",
-        // Suppress Go-Ahead: https://www.rfc-editor.org/rfc/rfc858.html
-        [3] = "SGA",
-        // Status: https://www.rfc-editor.org/rfc/rfc859.html
-        [5] = "STATUS",
-        // Terminal Type: https://www.rfc-editor.org/rfc/rfc1091.html
-        [24] = "TERMINAL-TYPE",
-        // Negotiate About Window Size: https://www.rfc-editor.org/rfc/rfc1073.html
-        [31] = "NAWS",
-        // Terminal Speed: https://www.rfc-editor.org/rfc/rfc1079.html
-        [32] = "TERMINAL-SPEED",
-        // Remote Flow Control: https://www.rfc-editor.org/rfc/rfc1372.html
-        [33] = "TOGGLE-FLOW-CONTROL",
-        // Line Mode: https://www.rfc-editor.org/rfc/rfc1184.html
-        [34] = "LINEMODE",
-        // New Environment Option: https://www.rfc-editor.org/rfc/rfc1572.html
-        [39] = "NEW-ENVIRON",
+// What each byte means outside of a sequence
+enum byte_class {
+    BYTE_IGNORED,
+    BYTE_ALPHA,
+    BYTE_DIGIT,
+    BYTE_SPACE,
+    BYTE_ENTER,
+    BYTE_REDRAW,
+    BYTE_ESC,
+    BYTE_IAC,
 };
 
-static bool parse_telnet_command(struct terminal *terminal, char **buf, size_t *len) {
-    // Escaped chr 255, which we don't care about
-    if ((*buf)[1] == *IAC) {
-        *buf += 2;
-        *len -= 2;
-        return true;
-    }
+static uint8_t const byte_classes[256] = {
+        ['A' ... 'Z'] = BYTE_ALPHA,
+        ['a' ... 'z'] = BYTE_ALPHA,
+        ['0' ... '9'] = BYTE_DIGIT,
+        [' '] = BYTE_SPACE,
+        ['\x0d'] = BYTE_ENTER,
+        // Ctrl-L redraws the screen, like in most terminal programs
+        ['\x0c'] = BYTE_REDRAW,
+        ['\x1b'] = BYTE_ESC,
+        [0xff] = BYTE_IAC,
+};
 
-    // Negotiations:
-    // IAC WILL/WONT/DO/DONT <option>
-    if (*len >= 3 &&
-        ((*buf)[1] == *WILL || (*buf)[1] == *WONT ||
-                (*buf)[1] == *DO || (*buf)[1] == *DONT)) {
-        char const action = (*buf)[1];
-        uint8_t const option_code = (*buf)[2];
+// Handle key presses up to the next byte that starts a sequence, which is
+// returned (or end if there's none). Nearly all input is spent here
+static uint8_t const *parse_keys(struct terminal *terminal, uint8_t const *p, uint8_t const *end) {
+    for (; p < end; p++) {
+        switch (byte_classes[*p]) {
+            case BYTE_ALPHA:
+                terminal->keyboard.alphas |= 1u << ((*p & 0xdf) - 'A');
+                push_event(terminal, *p);
+                break;
+            case BYTE_DIGIT:
+                terminal->keyboard.nums |= 1u << (*p - '0');
+                push_event(terminal, *p);
+                break;
+            case BYTE_SPACE:
+                terminal->keyboard.space = 1;
+                push_event(terminal, *p);
+                break;
+            case BYTE_ENTER:
+                terminal->keyboard.enter = 1;
+                push_event(terminal, *p);
+                break;
+            case BYTE_REDRAW:
+                terminal_resync(terminal);
+                break;
+            case BYTE_ESC:
+            case BYTE_IAC:
+                return p;
+        }
+    }
+    return p;
+}
 
-        char const * const option_name = negotiable_option_names[option_code];
-        LOG_DEBUG("Received Telnet negotiation: IAC %s %s(%u)",
-                  action == *WILL ? "WILL" : action == *WONT ? "WONT" : action == *DO ? "DO" : action == *DONT ? "DONT" : "???",
-                  option_name == NULL ? "???" : option_name,
-                  (uint8_t) option_code);
+// Feed a byte to the sequence being parsed. Returns false if the byte ended
+// the sequence without being part of it, so it has to be parsed again
+static bool parse_sequence(struct terminal *terminal, char c) {
+    switch (terminal->parse_state) {
+        case TERMINAL_PARSE_GROUND:
+            break;
+
+        case TERMINAL_PARSE_ESC:
+            // Cursor keys are sent as either CSI or SS3 sequences
+            if (c == '[' || c == 'O') {
+                terminal->parse_state = TERMINAL_PARSE_CSI;
+                terminal->parse_data_len = 0;
+                return true;
+            }
 
-        // "Negotiate About Window Size"
-        if (option_code == *NAWS) {
-            terminal->will_naws = (action == *WILL);
-        }
+            // Not a sequence, so the ESC was a key press of its own
+            terminal->keyboard.esc = 1;
+            push_event(terminal, INPUT_KEY_ESC);
+            terminal->parse_state = TERMINAL_PARSE_GROUND;
+            return false;
 
-        *buf += 3;
-        *len -= 3;
-        return true;
-    }
+        case TERMINAL_PARSE_CSI:
+            // Parameter and intermediate bytes, kept for the replies to our
+            // queries. None of the keys we care about need them
+            if (c >= 0x20 && c <= 0x3f) {
+                if (terminal->parse_data_len < TERMINAL_MAX_SB_LEN) {
+                    terminal->parse_data[terminal->parse_data_len++] = c;
+                }
+                return true;
+            }
 
-    // Sub-options:
-    // IAC SB <option> <values...> IAC SE
-    if (*len >= 5 && (*buf)[1] == *SB) {
-        uint8_t const option_code = (*buf)[2];
-
-        char const * const option_name = negotiable_option_names[option_code];
-        LOG_DEBUG("Received Telnet sub-negotiation: IAC SB %s(%u) ...",
-                  option_name == NULL ? "???" : option_name,
-                  (uint8_t) option_code);
-
-        if (option_code == *NAWS) {
-            char *original_buf = *buf;
-            size_t original_len = *len;
-            *buf += 3;
-            *len -= 3;
-
-            uint16_t cols = 0, rows = 0;
-            if (!parse_escaped_u16(buf, len, &cols) ||
-                    !parse_escaped_u16(buf, len, &rows) ||
-                    (*len >= 2 && (*buf)[0] != *IAC && (*buf)[1] != *SE)) {
-                *buf = original_buf;
-                *len = original_len;
+            terminal->parse_state = TERMINAL_PARSE_GROUND;
+            if (c < 0x40 || c > 0x7e) {
                 return false;
             }
 
-            LOG_DEBUG("Received NAWS: %d cols, %d rows", cols, rows);
+            if (c == 'A') {
+                terminal->keyboard.up = 1;
+                push_event(terminal, INPUT_KEY_UP);
+            }
+            else if (c == 'B') {
+                terminal->keyboard.down = 1;
+                push_event(terminal, INPUT_KEY_DOWN);
+            }
+            else if (c == 'C') {
+                terminal->keyboard.right = 1;
+                push_event(terminal, INPUT_KEY_RIGHT);
+            }
+            else if (c == 'D') {
+                terminal->keyboard.left = 1;
+                push_event(terminal, INPUT_KEY_LEFT);
+            }
+            else if (c == 'y') {
+                parse_mode_report(terminal, terminal->parse_data, terminal->parse_data_len);
+            }
+            return true;
+
+        case TERMINAL_PARSE_IAC:
+            terminal->parse_state = TERMINAL_PARSE_GROUND;
 
-            // The canvas must be at least 80x25 to render the game, so we
-            // blissfully ignore any smaller windows. We need an upperbound
-            // as well to prevent DoSing
-            uint16_t clamped_cols = SSB_CLAMP(cols, COLUMNS, 200);
-            uint16_t clamped_rows = SSB_CLAMP(rows, ROWS, 200);
-            if (clamped_cols != cols || clamped_rows != rows) {
-                LOG_INFO("Clamping NAWS resolution (%d cols, %d rows) to %d cols, %d rows",
-                        cols, rows, clamped_cols, clamped_rows);
+            if (c == *WILL || c == *WONT || c == *DO || c == *DONT) {
+                terminal->parse_command = c;
+                terminal->parse_state = TERMINAL_PARSE_OPTION;
+            }
+            else if (c == *SB) {
+                terminal->parse_state = TERMINAL_PARSE_SB;
             }
+            // "Are You There", which we answer by redrawing the screen
+            else if (c == *AYT) {
+                LOG_DEBUG("Received Telnet command: IAC AYT");
+                terminal_resync(terminal);
+            }
+            // Anything else, including an escaped 0xFF, is of no interest
+            return true;
 
-            canvas_resize(terminal->canvas, clamped_cols, clamped_rows);
+        case TERMINAL_PARSE_OPTION:
+            parse_negotiation(terminal, terminal->parse_command, (uint8_t) c);
+            terminal->parse_state = TERMINAL_PARSE_GROUND;
+            return true;
 
+        case TERMINAL_PARSE_SB:
+            terminal->parse_option = c;
+            terminal->parse_data_len = 0;
+            terminal->parse_state = TERMINAL_PARSE_SB_DATA;
             return true;
-        }
+
+        case TERMINAL_PARSE_SB_DATA:
+            if (c == *IAC) {
+                terminal->parse_state = TERMINAL_PARSE_SB_IAC;
+            }
+            else if (terminal->parse_data_len < TERMINAL_MAX_SB_LEN) {
+                terminal->parse_data[terminal->parse_data_len++] = c;
+            }
+            return true;
+
+        case TERMINAL_PARSE_SB_IAC:
+            if (c == *SE) {
+                parse_subnegotiation(terminal, (uint8_t) terminal->parse_option,
+                                     (uint8_t const *) terminal->parse_data, terminal->parse_data_len);
+                terminal->parse_state = TERMINAL_PARSE_GROUND;
+                return true;
+            }
+
+            // An escaped 0xFF within the data
+            if (c == *IAC) {
+                if (terminal->parse_data_len < TERMINAL_MAX_SB_LEN) {
+                    terminal->parse_data[terminal->parse_data_len++] = c;
+                }
+                terminal->parse_state = TERMINAL_PARSE_SB_DATA;
+                return true;
+            }
+
+            // The client never ended the sub-negotiation, so give up on it
+            // and take this as a command
+            terminal->parse_state = TERMINAL_PARSE_IAC;
+            return false;
     }
 
-    return false;
+    return true;
 }
 
 void terminal_parse(struct terminal *terminal, char *buf, size_t len) {
-    while (len) {
-        char ch = *buf;
-
-        // Escape sequences
-        if (ch == '\x1b' && len >= 2) {
-            // CSI sequences
-            if (buf[1] == '[' && len >= 3) {
-                // Move cursor
-                if (buf[2] >= 'A' && buf[2] <= 'D') {
-                   if (buf[2] == 'A') terminal->keyboard.up = 1;
-                   else if (buf[2] == 'B') terminal->keyboard.down = 1;
-                   else if (buf[2] == 'C') terminal->keyboard.right = 1;
-                   else if (buf[2] == 'D') terminal->keyboard.left = 1;
-
-                    buf += 3;
-                    len -= 3;
-                    continue;
-                }
+    uint8_t const *p = (uint8_t const *) buf;
+    uint8_t const *const end = p + len;
+
+    if (len > 0) {
+        terminal->parse_idle = false;
+        terminal->parse_time = timer_now();
+    }
+
+    while (p < end) {
+        if (terminal->parse_state == TERMINAL_PARSE_GROUND) {
+            p = parse_keys(terminal, p, end);
+            if (p == end) {
+                break;
             }
+
+            terminal->parse_state = (*p++ == 0x1b) ? TERMINAL_PARSE_ESC : TERMINAL_PARSE_IAC;
+            continue;
         }
-        else if (ch == ' ') {
-            terminal->keyboard.space = 1;
-        }
-        else if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')) {
-            unsigned place = (ch & 0xdf) - 'A';
-            terminal->keyboard.alphas |= 1u << place;
-        }
-        else if (ch >= '0' && ch <= '9') {
-            unsigned place = ch - '0';
-            terminal->keyboard.nums |= 1u << place;
+
+        if (parse_sequence(terminal, (char) *p)) {
+            p++;
         }
-        else if (ch == '\x0d') {
-            terminal->keyboard.enter = 1;
+    }
+}
+
+void terminal_tick(struct terminal *terminal) {
+    if (terminal->parse_state == TERMINAL_PARSE_ESC && terminal->parse_idle) {
+        terminal->keyboard.esc = 1;
+        push_event(terminal, INPUT_KEY_ESC);
+        terminal->parse_state = TERMINAL_PARSE_GROUND;
+    }
+
+    terminal->parse_idle = true;
+}
+
+TEST("[terminal] terminal_parse") {
+    struct canvas canvas;
+    canvas_create(&canvas, 80, 25);
+
+    struct terminal terminal;
+    terminal_create(&terminal, &canvas);
+
+    SUBTEST("keys are registered") {
+        terminal_parse(&terminal, "a Z5\r", 5);
+        REQUIRE(KEYBOARD_KEY_PRESSED(terminal.keyboard, 'A'));
+        REQUIRE(KEYBOARD_KEY_PRESSED(terminal.keyboard, 'Z'));
+        REQUIRE(KEYBOARD_KEY_PRESSED(terminal.keyboard, '5'));
+        REQUIRE(terminal.keyboard.space);
+        REQUIRE(terminal.keyboard.enter);
+        REQUIRE_FALSE(KEYBOARD_KEY_PRESSED(terminal.keyboard, 'B'));
+        KEYBOARD_CLEAR(terminal.keyboard);
+    }
+
+    SUBTEST("cursor keys split across reads") {
+        char keys[] = "\x1b[A\x1bOB\x1b[1;5C";
+        for (size_t i = 0; i < sizeof(keys) - 1; i++) {
+            terminal_parse(&terminal, &keys[i], 1);
         }
-        // This could also be triggered by unhandled escape sequences
-        else if (ch == '\x1b') {
-            terminal->keyboard.esc = 1;
+        REQUIRE(terminal.keyboard.up);
+        REQUIRE(terminal.keyboard.down);
+        REQUIRE(terminal.keyboard.right);
+        REQUIRE_FALSE(terminal.keyboard.esc);
+        REQUIRE_FALSE(KEYBOARD_KEY_PRESSED(terminal.keyboard, 'A'));
+        REQUIRE_FALSE(KEYBOARD_KEY_PRESSED(terminal.keyboard, 'O'));
+        REQUIRE_FALSE(KEYBOARD_KEY_PRESSED(terminal.keyboard, '1'));
+        KEYBOARD_CLEAR(terminal.keyboard);
+    }
+
+    SUBTEST("a lone ESC is a key press once nothing follows it") {
+        terminal_parse(&terminal, "\x1b", 1);
+        terminal_tick(&terminal);
+        REQUIRE_FALSE(terminal.keyboard.esc);
+        terminal_tick(&terminal);
+        REQUIRE(terminal.keyboard.esc);
+        KEYBOARD_CLEAR(terminal.keyboard);
+
+        terminal_parse(&terminal, "\x1bq", 2);
+        REQUIRE(terminal.keyboard.esc);
+        REQUIRE(KEYBOARD_KEY_PRESSED(terminal.keyboard, 'Q'));
+        KEYBOARD_CLEAR(terminal.keyboard);
+    }
+
+    SUBTEST("NAWS split at every byte, with escaped IACs") {
+        char naws[] = "\xff\xfa\x1f\x00\xff\xff\x00\x64\xff\xf0x";
+        for (size_t i = 0; i < sizeof(naws) - 1; i++) {
+            terminal_parse(&terminal, &naws[i], 1);
         }
-        // Telnet command
-        else if (ch == *IAC && len >= 2) {
-            if (parse_telnet_command(terminal, &buf, &len)) {
-                continue;
-            }
+        REQUIRE_EQ(canvas.w, 200);
+        REQUIRE_EQ(canvas.h, 100);
+        REQUIRE_EQ(terminal.parse_state, TERMINAL_PARSE_GROUND);
+        REQUIRE(KEYBOARD_KEY_PRESSED(terminal.keyboard, 'X'));
+        KEYBOARD_CLEAR(terminal.keyboard);
+    }
+
+    SUBTEST("synchronized output is detected from DECRQM replies") {
+        terminal_clear_events(&terminal);
+        char report[] = "\x1b[?2026;2$y";
+        for (size_t i = 0; i < sizeof(report) - 1; i++) {
+            terminal_parse(&terminal, &report[i], 1);
         }
+        REQUIRE(terminal.profile.sync_output);
+        REQUIRE_EQ(terminal.num_events, 0);
+
+        char unsupported[] = "\x1b[?2026;0$y";
+        terminal_parse(&terminal, unsupported, sizeof(unsupported) - 1);
+        REQUIRE_FALSE(terminal.profile.sync_output);
+        REQUIRE_EQ(terminal.num_events, 0);
+    }
+
+    SUBTEST("MTTS clients are asked until they've said everything") {
+        terminal.buffer_len = terminal.buffer_flushed_len = 0;
+        terminal_parse(&terminal, "\xff\xfb\x18", 3);
+        REQUIRE_EQ(terminal.num_ttype_requests, 1);
+
+        terminal_parse(&terminal, "\xff\xfa\x18\x00MUDLET\xff\xf0", 12);
+        REQUIRE_EQ(terminal.num_ttype_requests, 2);
+        terminal_parse(&terminal, "\xff\xfa\x18\x00" "ANSI-256COLOR\xff\xf0", 19);
+        REQUIRE_EQ(terminal.num_ttype_requests, 3);
+        REQUIRE(terminal.profile.utf8);
+
+        // ANSI and 256 colors, but no UTF-8
+        terminal_parse(&terminal, "\xff\xfa\x18\x00MTTS 9\xff\xf0", 12);
+        REQUIRE_EQ(terminal.num_ttype_requests, 3);
+        REQUIRE_FALSE(terminal.profile.utf8);
+        REQUIRE(canvas.features & CANVAS_FEATURE_LATIN1);
+        REQUIRE_FALSE(canvas.features & CANVAS_FEATURE_REP);
+        REQUIRE_EQ(terminal.buffer_len, 3 * 6);
+    }
+
+    SUBTEST("known terminals get the sequences they support") {
+        terminal_parse(&terminal, "\xff\xfa\x18\x00xterm-kitty\xff\xf0", 17);
+        REQUIRE(terminal.profile.rep);
+        REQUIRE(canvas.features & CANVAS_FEATURE_REP);
+
+        // Asked once more, and the repeated answer ends it
+        REQUIRE_EQ(terminal.num_ttype_requests, 4);
+        terminal_parse(&terminal, "\xff\xfa\x18\x00xterm-kitty\xff\xf0", 17);
+        REQUIRE_EQ(terminal.num_ttype_requests, 4);
+    }
 
-        buf++;
-        len--;
+    SUBTEST("negotiations split across reads") {
+        terminal_parse(&terminal, "\xff", 1);
+        terminal_parse(&terminal, "\xfb", 1);
+        terminal_parse(&terminal, "\x1f" "d", 2);
+        REQUIRE(terminal.will_naws);
+
+        terminal_parse(&terminal, "\xff\xfd", 2);
+        terminal_parse(&terminal, "\x19", 1);
+        REQUIRE(terminal.do_eor);
+        REQUIRE(KEYBOARD_KEY_PRESSED(terminal.keyboard, 'D'));
+        KEYBOARD_CLEAR(terminal.keyboard);
     }
+
+    terminal_destroy(&terminal);
+    canvas_destroy(&canvas);
 }
 
 bool terminal_flush(struct terminal *terminal, char *buf, size_t len, size_t *len_written) {
@@ -294,6 +612,10 @@ void terminal_write_bytes(struct terminal *terminal, char *buf, size_t len) {
     memcpy(&terminal->buffer[terminal->buffer_len], buf, len);
 
     terminal->buffer_len += len;
+
+    // Raw output may move the cursor or change attributes behind the canvas'
+    // back
+    canvas_forget_terminal_state(terminal->canvas);
 }
 
 void terminal_write(struct terminal *terminal, char *buf) {
@@ -308,9 +630,17 @@ void terminal_clear(struct terminal *terminal) {
     terminal_write(terminal, CSI "2J");
 }
 
+void terminal_resync(struct terminal *terminal) {
+    // Clear with the default background, since that's what the canvas assumes
+    // blank cells look like
+    terminal_write(terminal, CSI "m" CSI "2J");
+    canvas_resync(terminal->canvas);
+    terminal->resynced = true;
+}
+
 void terminal_move(struct terminal *terminal, unsigned x, unsigned y) {
-    char buf[20];
-    int len = snprintf(buf, 20, CSI "%d;%dH", y + 1, x + 1);
+    char buf[ESCAPE_MAX_LEN];
+    size_t len = escape_cup(buf, x, y);
     terminal_write_bytes(terminal, buf, len);
 }
 
@@ -318,20 +648,101 @@ void terminal_cursor(struct terminal *terminal, bool state) {
     terminal_write(terminal, state ? CSI "?25h" : CSI "?25l");
 }
 
-void terminal_get_directional_input(struct terminal *terminal,
-        struct directional_input *input, bool wasd) {
+bool terminal_next_event(struct terminal *terminal, struct input_event *event) {
+    if (terminal->num_events == 0) {
+        return false;
+    }
+
+    *event = terminal->events[terminal->events_head];
+    terminal->events_head = (terminal->events_head + 1) % TERMINAL_MAX_EVENTS;
+    terminal->num_events--;
+    return true;
+}
+
+void terminal_clear_events(struct terminal *terminal) {
+    terminal->events_head = terminal->num_events = 0;
+}
+
+static unsigned wasd_to_arrow(unsigned key) {
+    switch (key) {
+        case 'w': case 'W': return INPUT_KEY_UP;
+        case 's': case 'S': return INPUT_KEY_DOWN;
+        case 'a': case 'A': return INPUT_KEY_LEFT;
+        case 'd': case 'D': return INPUT_KEY_RIGHT;
+        default: return key;
+    }
+}
+
+bool terminal_next_direction(struct terminal *terminal, struct directional_input *input, bool wasd,
+                             uint64_t since) {
     *input = (struct directional_input){0};
 
-    if (wasd) {
-        input->up = KEYBOARD_KEY_PRESSED(terminal->keyboard, 'W');
-        input->down = KEYBOARD_KEY_PRESSED(terminal->keyboard, 'S');
-        input->left = KEYBOARD_KEY_PRESSED(terminal->keyboard, 'A');
-        input->right = KEYBOARD_KEY_PRESSED(terminal->keyboard, 'D');
+    struct input_event event;
+    while (terminal_next_event(terminal, &event)) {
+        if (event.time < since) {
+            continue;
+        }
+
+        switch (wasd ? wasd_to_arrow(event.key) : event.key) {
+            case INPUT_KEY_UP:
+                input->up = 1;
+                return true;
+            case INPUT_KEY_DOWN:
+                input->down = 1;
+                return true;
+            case INPUT_KEY_LEFT:
+                input->left = 1;
+                return true;
+            case INPUT_KEY_RIGHT:
+                input->right = 1;
+                return true;
+        }
     }
-    else {
-        input->up = terminal->keyboard.up;
-        input->down = terminal->keyboard.down;
-        input->left = terminal->keyboard.left;
-        input->right = terminal->keyboard.right;
+
+    return false;
+}
+
+TEST("[terminal] terminal_next_direction") {
+    struct canvas canvas;
+    canvas_create(&canvas, 80, 25);
+
+    struct terminal terminal;
+    terminal_create(&terminal, &canvas);
+
+    struct directional_input input;
+
+    SUBTEST("bursts within a tick are taken one at a time, in order") {
+        terminal_parse(&terminal, "\x1b[Dx\x1b[D\x1b[A", 10);
+        REQUIRE(terminal_next_direction(&terminal, &input, false, 0));
+        REQUIRE(input.left && !input.up);
+        REQUIRE(terminal_next_direction(&terminal, &input, false, 0));
+        REQUIRE(input.left && !input.up);
+        REQUIRE(terminal_next_direction(&terminal, &input, false, 0));
+        REQUIRE(input.up && !input.left);
+        REQUIRE_FALSE(terminal_next_direction(&terminal, &input, false, 0));
     }
+
+    SUBTEST("WASD can stand in for the arrows") {
+        terminal_parse(&terminal, "ds", 2);
+        REQUIRE(terminal_next_direction(&terminal, &input, true, 0));
+        REQUIRE(input.right);
+        REQUIRE_FALSE(terminal_next_direction(&terminal, &input, false, 0));
+    }
+
+    SUBTEST("stale presses are dropped") {
+        terminal_parse(&terminal, "\x1b[B", 3);
+        REQUIRE_FALSE(terminal_next_direction(&terminal, &input, false, terminal.parse_time + 1));
+    }
+
+    SUBTEST("the ring is bounded") {
+        for (int i = 0; i < TERMINAL_MAX_EVENTS * 2; i++) {
+            terminal_parse(&terminal, "x", 1);
+        }
+        REQUIRE_EQ(terminal.num_events, TERMINAL_MAX_EVENTS);
+        terminal_clear_events(&terminal);
+        REQUIRE_EQ(terminal.num_events, 0);
+    }
+
+    terminal_destroy(&terminal);
+    canvas_destroy(&canvas);
 }
@@ -8,6 +8,7 @@ extern "C" {
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
+#include "buffer.h"
 
 #define KEYBOARD_KEY_PRESSED(input, key) \
     (key >= '0' && key <= '9' ? \
@@ -50,15 +51,106 @@ struct keyboard_input {
 //    uint8_t page_down : 1;
 };
 
+// Keys that aren't characters, numbered past the range of bytes
+enum input_key {
+    INPUT_KEY_UP = 0x100,
+    INPUT_KEY_DOWN,
+    INPUT_KEY_LEFT,
+    INPUT_KEY_RIGHT,
+    INPUT_KEY_ESC,
+};
+
+// A key press, in the order it arrived
+struct input_event {
+    // When it was received, in nanoseconds of CLOCK_MONOTONIC (see timer_now)
+    uint64_t time;
+    // A character, or one of enum input_key
+    unsigned key;
+};
+
+// Key presses kept for screens that haven't gotten to them yet. Anything past
+// this is dropped
+#define TERMINAL_MAX_EVENTS 32
+
+// Where terminal_parse left off, since a sequence may be split across reads
+enum terminal_parse_state {
+    TERMINAL_PARSE_GROUND,
+    // ESC
+    TERMINAL_PARSE_ESC,
+    // ESC [ or ESC O, up to the final byte
+    TERMINAL_PARSE_CSI,
+    // IAC
+    TERMINAL_PARSE_IAC,
+    // IAC WILL/WONT/DO/DONT
+    TERMINAL_PARSE_OPTION,
+    // IAC SB
+    TERMINAL_PARSE_SB,
+    // IAC SB <option> ...
+    TERMINAL_PARSE_SB_DATA,
+    // IAC SB <option> ... IAC
+    TERMINAL_PARSE_SB_IAC,
+};
+
+// What we know the client supports, from TERMINAL-TYPE (including MTTS) and
+// DECRQM replies. Assumes little until told otherwise
+struct terminal_profile {
+    // Last terminal type the client reported, in lowercase
+    char type[32];
+    // Whether it takes UTF-8, as opposed to Latin-1
+    bool utf8;
+    // Repeat the preceding character (REP)
+    bool rep;
+    // Synchronized output (DEC mode 2026)
+    bool sync_output;
+};
+
+// Most TERMINAL-TYPE requests we send, which is enough for an MTTS client to
+// go through its name, its terminal type and its MTTS bits
+#define TERMINAL_MAX_TTYPE_REQUESTS 4
+
+// Longest sub-negotiation or CSI sequence we keep, past which the rest is
+// dropped
+#define TERMINAL_MAX_SB_LEN 64
+
 struct terminal {
     struct canvas *canvas;
 
     struct keyboard_input keyboard;
 
+    // Ring of key presses, oldest first
+    struct input_event events[TERMINAL_MAX_EVENTS];
+    size_t events_head, num_events;
+
     char buffer[4096];
     size_t buffer_len, buffer_flushed_len;
 
+    // Output encoded once and shared with other sessions (e.g. the frames of a
+    // game being watched), sent after the canvas
+    struct buffer_queue shared;
+    // Set whenever the client's screen is cleared by terminal_resync, for
+    // screens that send more than the canvas to notice and clear again
+    bool resynced;
+
     bool will_naws;
+    // Whether the client asked for MCCP2 compression
+    bool will_compress;
+    // Whether the client wants IAC EOR after each frame, and whether it
+    // agreed to go without IAC GA
+    bool do_eor, do_sga;
+    struct terminal_profile profile;
+    // TERMINAL-TYPE requests sent, since MTTS clients answer each one with
+    // something else
+    unsigned num_ttype_requests;
+
+    // The sequence being parsed, and when the input it's in arrived
+    enum terminal_parse_state parse_state;
+    uint64_t parse_time;
+    char parse_command, parse_option;
+    char parse_data[TERMINAL_MAX_SB_LEN];
+    size_t parse_data_len;
+    // Set every tick and cleared by any input, to tell a lone ESC apart from
+    // the start of a sequence whose rest is yet to arrive
+    bool parse_idle;
 };
 
 // Create a new terminal instance
@@ -67,8 +159,14 @@ bool terminal_create(struct terminal *terminal, struct canvas *canvas);
 // Destroy an existing terminal instance
 void terminal_destroy(struct terminal *terminal);
 
+// Parse input from the client. Sequences may be split across calls at any
+// byte, and are picked up where they left off
 void terminal_parse(struct terminal *terminal, char *buf, size_t len);
 
+// Called once per tick. An ESC that arrived a tick ago with nothing after it
+// is taken to be the Esc key
+void terminal_tick(struct terminal *terminal);
+
 bool terminal_flush(struct terminal *terminal, char *buf, size_t len,
                     size_t *len_written);
 
@@ -81,11 +179,24 @@ void terminal_reset(struct terminal *terminal);
 
 void terminal_clear(struct terminal *terminal);
 
+// Clear the client's screen and redraw the whole canvas, for when it may have
+// gotten out of sync with what we think it shows
+void terminal_resync(struct terminal *terminal);
+
 void terminal_move(struct terminal *terminal, unsigned x, unsigned y);
 
 void terminal_cursor(struct terminal *terminal, bool state);
 
-void terminal_get_directional_input(struct terminal *terminal, struct directional_input *input, bool wasd);
+// Take the oldest key press. Returns false if there are none
+bool terminal_next_event(struct terminal *terminal, struct input_event *event);
+
+void terminal_clear_events(struct terminal *terminal);
+
+// Take the oldest direction pressed at or after the given time, dropping any
+// other key presses before it. Returns false (with an empty input) if there
+// are none
+bool terminal_next_direction(struct terminal *terminal, struct directional_input *input, bool wasd,
+                             uint64_t since);
 
 #ifdef __cplusplus
 }
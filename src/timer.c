@@ -0,0 +1,265 @@
+#include <baro.h>
+#include <time.h>
+#include <limits.h>
+#include "timer.h"
+
+uint64_t timer_now(void) {
+    struct timespec current;
+    clock_gettime(CLOCK_MONOTONIC, &current);
+    return (uint64_t) current.tv_sec * 1000000000ull + (uint64_t) current.tv_nsec;
+}
+
+void timer_init(struct timer *timer, void *data) {
+    timer->deadline = 0;
+    timer->data = data;
+    timer->list = NULL;
+    timer->prev = timer->next = NULL;
+}
+
+void timer_wheel_create(struct timer_wheel *wheel, uint64_t now) {
+    *wheel = (struct timer_wheel){0};
+    wheel->now = now / TIMER_RESOLUTION_NS;
+    wheel->now_ns = now;
+}
+
+static void link_timer(struct timer **list, struct timer *timer) {
+    timer->list = list;
+    timer->prev = NULL;
+    timer->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = timer;
+    }
+    *list = timer;
+}
+
+static void unlink_timer(struct timer *timer) {
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        *timer->list = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+    timer->list = NULL;
+    timer->prev = timer->next = NULL;
+}
+
+static void place_timer(struct timer_wheel *wheel, struct timer *timer) {
+    if (timer->deadline <= wheel->now_ns) {
+        link_timer(&wheel->expired, timer);
+        return;
+    }
+
+    uint64_t const expiry = timer->deadline / TIMER_RESOLUTION_NS;
+
+    // Find the lowest level where the expiry lands within the next lap
+    for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned const shift = level * TIMER_WHEEL_BITS;
+        if ((expiry >> shift) - (wheel->now >> shift) < TIMER_WHEEL_SLOTS) {
+            unsigned const index = (expiry >> shift) & (TIMER_WHEEL_SLOTS - 1);
+            link_timer(&wheel->slots[level][index], timer);
+            return;
+        }
+    }
+
+    // Too far out for the wheel, so park it in the last slot of the top level.
+    // It will be re-placed when that slot cascades
+    unsigned const shift = (TIMER_WHEEL_LEVELS - 1) * TIMER_WHEEL_BITS;
+    unsigned const index = ((wheel->now >> shift) - 1) & (TIMER_WHEEL_SLOTS - 1);
+    link_timer(&wheel->slots[TIMER_WHEEL_LEVELS - 1][index], timer);
+}
+
+void timer_schedule(struct timer_wheel *wheel, struct timer *timer, uint64_t deadline) {
+    if (timer_is_scheduled(timer)) {
+        timer_cancel(wheel, timer);
+    }
+
+    timer->deadline = deadline;
+    place_timer(wheel, timer);
+    wheel->num_timers++;
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer) {
+    if (!timer_is_scheduled(timer)) {
+        return;
+    }
+
+    unlink_timer(timer);
+    wheel->num_timers--;
+}
+
+static void cascade(struct timer_wheel *wheel, unsigned level) {
+    unsigned const shift = level * TIMER_WHEEL_BITS;
+    struct timer **slot = &wheel->slots[level][(wheel->now >> shift) & (TIMER_WHEEL_SLOTS - 1)];
+
+    struct timer *timer;
+    while ((timer = *slot) != NULL) {
+        unlink_timer(timer);
+        place_timer(wheel, timer);
+    }
+}
+
+// Move everything in the current slot of the lowest level that's due. Only
+// the slot the wheel is currently in can hold timers that aren't due yet, so
+// a timer never fires before its deadline
+static void expire_current_slot(struct timer_wheel *wheel) {
+    struct timer *timer = wheel->slots[0][wheel->now & (TIMER_WHEEL_SLOTS - 1)];
+    while (timer != NULL) {
+        struct timer *next = timer->next;
+        if (timer->deadline <= wheel->now_ns) {
+            unlink_timer(timer);
+            link_timer(&wheel->expired, timer);
+        }
+        timer = next;
+    }
+}
+
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now) {
+    uint64_t const target = now / TIMER_RESOLUTION_NS;
+    if (now > wheel->now_ns) {
+        wheel->now_ns = now;
+    }
+
+    expire_current_slot(wheel);
+
+    while (wheel->expired == NULL && wheel->now < target) {
+        // Nothing can fire in between, so jump straight to the target
+        if (wheel->num_timers == 0) {
+            wheel->now = target;
+            break;
+        }
+
+        wheel->now++;
+
+        // When a level wraps around, redistribute the next slot of the level
+        // above it. Higher levels go first so their timers can trickle down
+        unsigned wrapped = 0;
+        while (wrapped + 1 < TIMER_WHEEL_LEVELS &&
+                (wheel->now & ((1ull << ((wrapped + 1) * TIMER_WHEEL_BITS)) - 1)) == 0) {
+            wrapped++;
+        }
+        for (unsigned level = wrapped; level > 0; level--) {
+            cascade(wheel, level);
+        }
+
+        expire_current_slot(wheel);
+    }
+
+    struct timer *timer = wheel->expired;
+    if (timer != NULL) {
+        unlink_timer(timer);
+        wheel->num_timers--;
+    }
+    return timer;
+}
+
+static uint64_t earliest_deadline(struct timer *list) {
+    uint64_t deadline = UINT64_MAX;
+    for (struct timer *timer = list; timer != NULL; timer = timer->next) {
+        if (timer->deadline < deadline) {
+            deadline = timer->deadline;
+        }
+    }
+    return deadline;
+}
+
+uint64_t timer_wheel_next_deadline(struct timer_wheel *wheel) {
+    if (wheel->num_timers == 0) {
+        return UINT64_MAX;
+    }
+
+    uint64_t deadline = earliest_deadline(wheel->expired);
+
+    // Slots within a level are ordered by time starting from the wheel's
+    // position, so only the first occupied slot of each level can hold that
+    // level's earliest timer
+    for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned const shift = level * TIMER_WHEEL_BITS;
+        unsigned const start = (wheel->now >> shift) & (TIMER_WHEEL_SLOTS - 1);
+        for (unsigned i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            struct timer *list = wheel->slots[level][(start + i) & (TIMER_WHEEL_SLOTS - 1)];
+            if (list != NULL) {
+                uint64_t const level_deadline = earliest_deadline(list);
+                if (level_deadline < deadline) {
+                    deadline = level_deadline;
+                }
+                break;
+            }
+        }
+    }
+
+    return deadline;
+}
+
+int timer_wheel_timeout_ms(struct timer_wheel *wheel, uint64_t now) {
+    uint64_t const deadline = timer_wheel_next_deadline(wheel);
+    if (deadline == UINT64_MAX) {
+        return -1;
+    }
+    if (deadline <= now) {
+        return 0;
+    }
+
+    uint64_t const timeout = (deadline - now + TIMER_RESOLUTION_NS - 1) / TIMER_RESOLUTION_NS;
+    return timeout > INT_MAX ? INT_MAX : (int) timeout;
+}
+
+TEST("[timer] timer_wheel_expire") {
+    uint64_t const ms = 1000000;
+    uint64_t const start = 12345 * ms + 678;
+
+    struct timer_wheel wheel;
+    timer_wheel_create(&wheel, start);
+
+    struct timer a, b, c, d;
+    timer_init(&a, &a);
+    timer_init(&b, &b);
+    timer_init(&c, &c);
+    timer_init(&d, &d);
+
+    timer_schedule(&wheel, &a, start + 100 * ms);
+    timer_schedule(&wheel, &b, start + 5000 * ms);
+    timer_schedule(&wheel, &c, start + 30 * ms + 1);
+    timer_schedule(&wheel, &d, start - 1);
+    REQUIRE_EQ(wheel.num_timers, 4);
+
+    SUBTEST("overdue timers fire immediately") {
+        REQUIRE_EQ(timer_wheel_next_deadline(&wheel), start - 1);
+        REQUIRE_EQ(timer_wheel_expire(&wheel, start), &d);
+        REQUIRE_EQ(timer_wheel_expire(&wheel, start), NULL);
+    }
+
+    SUBTEST("timers never fire early") {
+        REQUIRE_EQ(timer_wheel_next_deadline(&wheel), start + 30 * ms + 1);
+        REQUIRE_EQ(timer_wheel_expire(&wheel, start + 30 * ms), NULL);
+        REQUIRE_EQ(timer_wheel_timeout_ms(&wheel, start + 30 * ms), 1);
+        REQUIRE_EQ(timer_wheel_expire(&wheel, start + 31 * ms), &c);
+    }
+
+    SUBTEST("cancelled timers don't fire") {
+        timer_cancel(&wheel, &a);
+        REQUIRE_FALSE(timer_is_scheduled(&a));
+        REQUIRE_EQ(timer_wheel_next_deadline(&wheel), start + 5000 * ms);
+        REQUIRE_EQ(timer_wheel_expire(&wheel, start + 4999 * ms), NULL);
+    }
+
+    SUBTEST("timers cascade down from higher levels") {
+        REQUIRE_EQ(timer_wheel_expire(&wheel, start + 5000 * ms), &b);
+        REQUIRE_EQ(wheel.num_timers, 0);
+        REQUIRE_EQ(timer_wheel_timeout_ms(&wheel, start), -1);
+    }
+
+    SUBTEST("periodic timers don't drift") {
+        uint64_t deadline = start + 5000 * ms;
+        for (int i = 0; i < 1000; i++) {
+            deadline += 100 * ms;
+            timer_schedule(&wheel, &a, deadline);
+
+            // Wake up late every time
+            struct timer *timer = timer_wheel_expire(&wheel, deadline + 7 * ms);
+            REQUIRE_EQ(timer, &a);
+            REQUIRE_EQ(timer->deadline, deadline);
+        }
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef SSB_TIMER_H
+#define SSB_TIMER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Width of a slot in the lowest level of the wheel
+#define TIMER_RESOLUTION_NS 1000000ull
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_BITS)
+// Four levels of 64 slots cover ~4.6 hours at a 1 ms resolution. Anything
+// further out waits in the last slot and gets cascaded again
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer {
+    // Absolute deadline, in nanoseconds of CLOCK_MONOTONIC
+    uint64_t deadline;
+
+    // Opaque pointer for the owner of the timer
+    void *data;
+
+    // List the timer is currently linked into, or NULL if it isn't scheduled
+    struct timer **list;
+    struct timer *prev, *next;
+};
+
+// Hierarchical timing wheel (Varghese & Lauck). Scheduling and cancelling are
+// O(1), and expiring is O(1) per timer plus a cascade every 64 slots
+struct timer_wheel {
+    // Current position of the wheel, in units of TIMER_RESOLUTION_NS
+    uint64_t now;
+    // Time the wheel was last advanced to, in nanoseconds
+    uint64_t now_ns;
+
+    size_t num_timers;
+
+    struct timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+    // Timers whose deadline has been reached but that haven't been returned
+    // by timer_wheel_expire yet
+    struct timer *expired;
+};
+
+// Current CLOCK_MONOTONIC time in nanoseconds
+uint64_t timer_now(void);
+
+void timer_init(struct timer *timer, void *data);
+
+static inline bool timer_is_scheduled(struct timer const *timer) {
+    return timer->list != NULL;
+}
+
+void timer_wheel_create(struct timer_wheel *wheel, uint64_t now);
+
+// (Re)schedule a timer. Deadlines that already passed expire on the next call
+// to timer_wheel_expire
+void timer_schedule(struct timer_wheel *wheel, struct timer *timer, uint64_t deadline);
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+
+// Advance the wheel to the given time, and pop one timer whose deadline has
+// passed. Returns NULL once nothing else is due
+struct timer *timer_wheel_expire(struct timer_wheel *wheel, uint64_t now);
+
+// Earliest deadline of any scheduled timer, or UINT64_MAX if there are none
+uint64_t timer_wheel_next_deadline(struct timer_wheel *wheel);
+
+// Milliseconds to sleep until the next deadline (rounded up so we don't wake
+// early), or -1 to sleep indefinitely
+int timer_wheel_timeout_ms(struct timer_wheel *wheel, uint64_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //SSB_TIMER_H